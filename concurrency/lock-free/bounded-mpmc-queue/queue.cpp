@@ -0,0 +1,264 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bounded multi-producer multi-consumer queue after Dmitry Vyukov. Each
+// slot carries a sequence number: a slot at position pos is free for the
+// producer of pos when its sequence is pos, and holds a value for the
+// consumer of pos when it is pos + 1; the consumer then hands it to the
+// producer one lap later by setting it to pos + capacity. Producers and
+// consumers only contend on their own position counter, and each slot
+// sits on its own cache line so neighbours do not false-share.
+//
+// A claimed slot is always handed on, even when T throws. A producer whose
+// value fails to construct publishes its slot marked as abandoned, and the
+// consumer of that position skips it. A consumer whose move out of a slot
+// throws destroys the value and releases the slot, along with the rest of
+// its batch.
+template <typename T>
+class bounded_mpmc_queue {
+private:
+    static std::size_t const cache_line = 64;
+
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        // Published without a value; see abandon_push.
+        bool abandoned;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        T &data() {
+            return *reinterpret_cast<T*>(&storage);
+        }
+    };
+
+    static std::size_t const slot_stride =
+        (sizeof(slot) + cache_line - 1) / cache_line * cache_line;
+
+    char pad0[cache_line];
+    std::atomic<std::size_t> enqueue_pos;
+    char pad1[cache_line - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> dequeue_pos;
+    char pad2[cache_line - sizeof(std::atomic<std::size_t>)];
+
+    std::size_t const mask;
+    void *buffer;
+    char *slots;
+
+    static std::size_t round_up_to_power_of_two(std::size_t n) {
+        std::size_t res = 1;
+        while (res < n) {
+            res <<= 1;
+        }
+        return res;
+    }
+
+    slot &slot_at(std::size_t pos) const {
+        return *reinterpret_cast<slot*>(slots + (pos & mask) * slot_stride);
+    }
+
+    // Claims up to n consecutive positions whose slots are in the state
+    // ready(slot, position) wants, returning the first through pos.
+    template <typename Ready>
+    std::size_t claim(std::atomic<std::size_t> &position, std::size_t n,
+                      std::size_t &pos, Ready ready) {
+        pos = position.load(std::memory_order_relaxed);
+        for (;;) {
+            std::size_t k = 0;
+            while (k < n) {
+                std::size_t const seq =
+                    slot_at(pos + k).sequence.load(std::memory_order_acquire);
+                std::intptr_t const diff = ready(seq, pos + k);
+                if (diff == 0) {
+                    ++k;
+                } else if (diff < 0 || k > 0) {
+                    break;
+                } else {
+                    // Another thread took pos; start again from its end.
+                    k = n + 1;
+                }
+            }
+            if (k == n + 1) {
+                pos = position.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (k == 0) {
+                return 0;
+            }
+            if (position.compare_exchange_weak(pos, pos + k,
+                                               std::memory_order_relaxed)) {
+                return k;
+            }
+        }
+    }
+
+    struct push_ready {
+        std::intptr_t operator()(std::size_t seq, std::size_t pos) const {
+            return std::intptr_t(seq) - std::intptr_t(pos);
+        }
+    };
+
+    struct pop_ready {
+        std::intptr_t operator()(std::size_t seq, std::size_t pos) const {
+            return std::intptr_t(seq) - std::intptr_t(pos + 1);
+        }
+    };
+
+    void publish_push(std::size_t pos) {
+        slot_at(pos).sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void publish_pop(std::size_t pos) {
+        slot_at(pos).sequence.store(pos + mask + 1, std::memory_order_release);
+    }
+
+    // Hands a claimed slot on to its consumer without a value once
+    // constructing the value has thrown.
+    void abandon_push(std::size_t pos) {
+        slot_at(pos).abandoned = true;
+        publish_push(pos);
+    }
+
+    // Releases a claimed slot, discarding its value.
+    void drop(std::size_t pos) {
+        slot &s = slot_at(pos);
+        if (s.abandoned) {
+            s.abandoned = false;
+        } else {
+            s.data().~T();
+        }
+        publish_pop(pos);
+    }
+
+    // Moves the value at a claimed position into dest and releases the
+    // slot; returns false if the slot was abandoned.
+    template <typename Dest>
+    bool take(std::size_t pos, Dest &&dest) {
+        slot &s = slot_at(pos);
+        if (s.abandoned) {
+            drop(pos);
+            return false;
+        }
+        try {
+            dest = std::move(s.data());
+        } catch (...) {
+            drop(pos);
+            throw;
+        }
+        drop(pos);
+        return true;
+    }
+
+public:
+    // capacity is rounded up to a power of two.
+    explicit bounded_mpmc_queue(std::size_t capacity):
+        enqueue_pos(0), dequeue_pos(0),
+        mask(round_up_to_power_of_two(capacity < 2 ? 2 : capacity) - 1),
+        buffer(::operator new((mask + 1) * slot_stride + cache_line)),
+        slots(reinterpret_cast<char*>(
+            (reinterpret_cast<std::uintptr_t>(buffer) + cache_line - 1) &
+            ~std::uintptr_t(cache_line - 1))) {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            new (&slot_at(i).sequence) std::atomic<std::size_t>(i);
+            slot_at(i).abandoned = false;
+        }
+    }
+
+    bounded_mpmc_queue(bounded_mpmc_queue const &) = delete;
+    bounded_mpmc_queue &operator=(bounded_mpmc_queue const &) = delete;
+
+    ~bounded_mpmc_queue() {
+        std::size_t const last = enqueue_pos.load();
+        for (std::size_t pos = dequeue_pos.load(); pos != last; ++pos) {
+            if (!slot_at(pos).abandoned) {
+                slot_at(pos).data().~T();
+            }
+        }
+        ::operator delete(buffer);
+    }
+
+    std::size_t capacity() const {
+        return mask + 1;
+    }
+
+    // Approximate while other threads are pushing or popping.
+    std::size_t size() const {
+        std::size_t const head = dequeue_pos.load(std::memory_order_relaxed);
+        std::size_t const tail = enqueue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    template <typename U>
+    bool try_push(U &&value) {
+        std::size_t pos;
+        if (!claim(enqueue_pos, 1, pos, push_ready())) {
+            return false;
+        }
+        try {
+            new (&slot_at(pos).storage) T(std::forward<U>(value));
+        } catch (...) {
+            abandon_push(pos);
+            throw;
+        }
+        publish_push(pos);
+        return true;
+    }
+
+    bool try_pop(T &value) {
+        std::size_t pos;
+        do {
+            if (!claim(dequeue_pos, 1, pos, pop_ready())) {
+                return false;
+            }
+        } while (!take(pos, value));
+        return true;
+    }
+
+    // Pushes up to n values from first with one claim on the shared
+    // position; returns how many were pushed. If constructing a value
+    // throws, the ones before it stay pushed.
+    template <typename InputIt>
+    std::size_t try_push_n(InputIt first, std::size_t n) {
+        std::size_t pos;
+        std::size_t const k = claim(enqueue_pos, n, pos, push_ready());
+        std::size_t i = 0;
+        try {
+            for (; i < k; ++i, ++first) {
+                new (&slot_at(pos + i).storage) T(*first);
+                publish_push(pos + i);
+            }
+        } catch (...) {
+            for (; i < k; ++i) {
+                abandon_push(pos + i);
+            }
+            throw;
+        }
+        return k;
+    }
+
+    // Pops up to n values into out; returns how many were popped. If
+    // writing one to out throws, it and the rest of the batch are lost.
+    template <typename OutputIt>
+    std::size_t try_pop_n(OutputIt out, std::size_t n) {
+        std::size_t pos;
+        std::size_t const k = claim(dequeue_pos, n, pos, pop_ready());
+        std::size_t popped = 0;
+        std::size_t i = 0;
+        try {
+            for (; i < k; ++i) {
+                if (take(pos + i, *out)) {
+                    ++out;
+                    ++popped;
+                }
+            }
+        } catch (...) {
+            for (++i; i < k; ++i) {
+                drop(pos + i);
+            }
+            throw;
+        }
+        return popped;
+    }
+};
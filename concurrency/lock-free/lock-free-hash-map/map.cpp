@@ -0,0 +1,426 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include "../reclamation/hazard_pointer.h"
+
+// Lock-free hash map using split-ordered lists (Shalev and Shavit). All
+// entries live in one lock-free sorted list (Michael) ordered by their
+// bit-reversed hash, and each bucket is a dummy node in that list marking
+// where its entries start. Doubling the bucket count never moves an entry:
+// a new bucket is initialised lazily by splicing its dummy in after the
+// dummy of its parent bucket, which is the one with the top bit cleared.
+//
+// Nodes and values are reclaimed with the repo's hazard pointers. Each
+// operation claims four of its thread's hazard slots, so it nests inside
+// any guards the caller holds: a traversal keeps prev, curr and next in
+// its slots 2, 1 and 0, and a reader copying a value keeps it in slot 3,
+// so updates can swap values under readers. Finds are lock-free rather than wait-free: they retry if a node
+// they stand on is unlinked under them, and help unlink marked nodes.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class lock_free_hash_map {
+private:
+    // Dummy nodes are plain nodes; entries are item_nodes. Dummies have
+    // even split-order keys and entries odd ones, so they never compare
+    // equal.
+    struct node {
+        std::size_t so_key;
+        std::atomic<node*> next;
+
+        explicit node(std::size_t so_key_):
+            so_key(so_key_), next(nullptr) {
+        }
+    };
+
+    struct item_node : node {
+        Key key;
+        std::atomic<Value*> value;
+
+        item_node(std::size_t so_key_, Key const &key_, Value *value_):
+            node(so_key_), key(key_), value(value_) {
+        }
+    };
+
+    static unsigned const max_segments = sizeof(std::size_t) * 8;
+    static std::size_t const max_load = 2;
+    static std::size_t const high_bit = std::size_t(1) <<
+        (sizeof(std::size_t) * 8 - 1);
+
+    // Bucket b lives in segment s = floor(log2(b)), at b - 2^s; segment 0
+    // holds buckets 0 and 1. Segments are allocated on first use and never
+    // move, so the bucket table grows without copying.
+    std::atomic<std::atomic<node*>*> segments[max_segments];
+    std::atomic<std::size_t> bucket_count;
+    std::atomic<std::size_t> item_count;
+    Hash hasher;
+
+    static std::size_t round_up_to_power_of_two(std::size_t n) {
+        std::size_t res = 2;
+        while (res < n && res < high_bit) {
+            res <<= 1;
+        }
+        return res;
+    }
+
+    static std::size_t reverse_bits(std::size_t v) {
+        static unsigned char const table[16] = {
+            0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+            0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+        };
+        std::size_t res = 0;
+        for (unsigned i = 0; i < sizeof(std::size_t) * 2; ++i) {
+            res = (res << 4) | table[v & 0xf];
+            v >>= 4;
+        }
+        return res;
+    }
+
+    static std::size_t item_key(std::size_t hash) {
+        return reverse_bits(hash | high_bit);
+    }
+
+    static std::size_t dummy_key(std::size_t bucket) {
+        return reverse_bits(bucket);
+    }
+
+    // A set low bit in next marks the node as logically erased.
+    static bool is_marked(node *p) {
+        return reinterpret_cast<std::uintptr_t>(p) & 1;
+    }
+
+    static node *marked(node *p) {
+        return reinterpret_cast<node*>(reinterpret_cast<std::uintptr_t>(p) | 1);
+    }
+
+    static node *unmarked(node *p) {
+        return reinterpret_cast<node*>(
+            reinterpret_cast<std::uintptr_t>(p) & ~std::uintptr_t(1));
+    }
+
+    static void delete_item(void *p) {
+        item_node *const n = static_cast<item_node*>(p);
+        delete n->value.load(std::memory_order_relaxed);
+        delete n;
+    }
+
+    static void retire_item(node *n) {
+        hazard_state_for_current_thread().retire(
+            static_cast<item_node*>(n), &delete_item);
+    }
+
+    static_assert(hazard_pointers_per_thread >= 4,
+                  "lock_free_hash_map needs four hazard pointers per thread");
+
+    // The four hazard slots an operation uses, claimed from the thread's
+    // record for its duration and cleared when it ends.
+    class hazards {
+    private:
+        hazard_thread_state &state;
+        unsigned slots[4];
+
+    public:
+        hazards(hazards const &) = delete;
+        hazards &operator=(hazards const &) = delete;
+
+        hazards():
+            state(hazard_state_for_current_thread()) {
+            unsigned claimed = 0;
+            try {
+                for (; claimed < 4; ++claimed) {
+                    slots[claimed] = state.claim_pointer();
+                }
+            } catch (...) {
+                while (claimed) {
+                    state.release_pointer(slots[--claimed]);
+                }
+                throw;
+            }
+        }
+
+        ~hazards() {
+            for (unsigned i = 0; i < 4; ++i) {
+                state.release_pointer(slots[i]);
+            }
+        }
+
+        void set(unsigned slot, void *p) {
+            state.pointer(slots[slot]).store(p);
+        }
+    };
+
+    struct position {
+        node *prev;
+        node *curr;
+    };
+
+    static bool matches(node *n, std::size_t so_key, Key const *key) {
+        return n->so_key == so_key &&
+            (!key || static_cast<item_node*>(n)->key == *key);
+    }
+
+    // Finds the node with so_key (and key, for entries) in the list after
+    // start, or where it would go: curr is the first node past it. On
+    // return curr is protected by slot 1 and prev, unless it is the dummy
+    // start, by slot 2. Marked nodes met on the way are unlinked.
+    bool search(node *start, std::size_t so_key, Key const *key, hazards &hp,
+                position &pos) {
+    try_again:
+        node *prev = start;
+        node *curr = prev->next.load();
+        hp.set(1, curr);
+        if (prev->next.load() != curr) {
+            goto try_again;
+        }
+        for (;;) {
+            if (!curr) {
+                pos.prev = prev;
+                pos.curr = nullptr;
+                return false;
+            }
+            node *const next = curr->next.load();
+            hp.set(0, unmarked(next));
+            if (curr->next.load() != next || prev->next.load() != curr) {
+                goto try_again;
+            }
+            if (is_marked(next)) {
+                node *expected = curr;
+                if (!prev->next.compare_exchange_strong(expected,
+                                                        unmarked(next))) {
+                    goto try_again;
+                }
+                retire_item(curr);
+            } else {
+                if (curr->so_key > so_key) {
+                    pos.prev = prev;
+                    pos.curr = curr;
+                    return false;
+                }
+                if (matches(curr, so_key, key)) {
+                    pos.prev = prev;
+                    pos.curr = curr;
+                    return true;
+                }
+                prev = curr;
+                hp.set(2, prev);
+            }
+            curr = unmarked(next);
+            hp.set(1, curr);
+        }
+    }
+
+    std::atomic<node*> &bucket_slot(std::size_t bucket) {
+        unsigned segment = 0;
+        std::size_t offset = bucket;
+        if (bucket >= 2) {
+            while ((bucket >> (segment + 1)) != 0) {
+                ++segment;
+            }
+            offset = bucket - (std::size_t(1) << segment);
+        }
+        std::atomic<node*> *table = segments[segment].load();
+        if (!table) {
+            std::size_t const size =
+                segment == 0 ? 2 : std::size_t(1) << segment;
+            std::atomic<node*> *const fresh = new std::atomic<node*>[size];
+            for (std::size_t i = 0; i < size; ++i) {
+                fresh[i].store(nullptr, std::memory_order_relaxed);
+            }
+            if (segments[segment].compare_exchange_strong(table, fresh)) {
+                table = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        return table[offset];
+    }
+
+    // Returns the dummy of bucket, splicing it in first if needed. Dummies
+    // are never erased, so callers may use them without hazard pointers.
+    node *get_bucket(std::size_t bucket, hazards &hp) {
+        std::atomic<node*> &slot = bucket_slot(bucket);
+        node *dummy = slot.load(std::memory_order_acquire);
+        if (dummy) {
+            return dummy;
+        }
+        std::size_t parent = bucket;
+        for (std::size_t bit = high_bit; bit; bit >>= 1) {
+            if (parent & bit) {
+                parent &= ~bit;
+                break;
+            }
+        }
+        node *const parent_dummy = get_bucket(parent, hp);
+        node *const fresh = new node(dummy_key(bucket));
+        position pos;
+        for (;;) {
+            if (search(parent_dummy, fresh->so_key, nullptr, hp, pos)) {
+                delete fresh;
+                dummy = pos.curr;
+                break;
+            }
+            fresh->next.store(pos.curr, std::memory_order_relaxed);
+            node *expected = pos.curr;
+            if (pos.prev->next.compare_exchange_strong(expected, fresh)) {
+                dummy = fresh;
+                break;
+            }
+        }
+        slot.store(dummy, std::memory_order_release);
+        return dummy;
+    }
+
+    node *bucket_for(std::size_t hash, hazards &hp) {
+        return get_bucket(hash & (bucket_count.load() - 1), hp);
+    }
+
+    void note_insert() {
+        std::size_t const count = item_count.fetch_add(1) + 1;
+        std::size_t size = bucket_count.load();
+        if (count > size * max_load && size < high_bit) {
+            bucket_count.compare_exchange_strong(size, size * 2);
+        }
+    }
+
+    // Inserts key if absent; otherwise replaces its value if replace is
+    // set. Returns true if key was absent.
+    bool insert_or_assign(Key const &key, Value const &value, bool replace) {
+        std::size_t const hash = hasher(key);
+        std::size_t const so_key = item_key(hash);
+        Value *const new_value = new Value(value);
+        item_node *fresh = nullptr;
+        hazards hp;
+        node *const start = bucket_for(hash, hp);
+        position pos;
+        for (;;) {
+            if (search(start, so_key, &key, hp, pos)) {
+                if (replace) {
+                    item_node *const found = static_cast<item_node*>(pos.curr);
+                    Value *const old = found->value.exchange(new_value);
+                    hazard_state_for_current_thread().retire(
+                        old, &do_delete<Value>);
+                } else {
+                    delete new_value;
+                }
+                if (fresh) {
+                    fresh->value.store(nullptr, std::memory_order_relaxed);
+                    delete fresh;
+                }
+                return false;
+            }
+            if (!fresh) {
+                fresh = new item_node(so_key, key, new_value);
+            }
+            fresh->next.store(pos.curr, std::memory_order_relaxed);
+            node *expected = pos.curr;
+            if (pos.prev->next.compare_exchange_strong(expected, fresh)) {
+                note_insert();
+                return true;
+            }
+        }
+    }
+
+public:
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef Hash hash_type;
+
+    // initial_buckets is rounded up to a power of two.
+    explicit lock_free_hash_map(std::size_t initial_buckets = 16,
+                                Hash const &hasher_ = Hash()):
+        bucket_count(round_up_to_power_of_two(initial_buckets)),
+        item_count(0), hasher(hasher_) {
+        for (unsigned i = 0; i < max_segments; ++i) {
+            segments[i].store(nullptr, std::memory_order_relaxed);
+        }
+        bucket_slot(0).store(new node(dummy_key(0)));
+    }
+
+    lock_free_hash_map(lock_free_hash_map const &) = delete;
+    lock_free_hash_map &operator=(lock_free_hash_map const &) = delete;
+
+    ~lock_free_hash_map() {
+        node *current = bucket_slot(0).load();
+        while (current) {
+            node *const next = unmarked(current->next.load());
+            if (current->so_key & 1) {
+                delete_item(static_cast<item_node*>(current));
+            } else {
+                delete current;
+            }
+            current = next;
+        }
+        for (unsigned i = 0; i < max_segments; ++i) {
+            delete[] segments[i].load();
+        }
+    }
+
+    // Approximate while other threads are inserting or erasing.
+    std::size_t size() const {
+        return item_count.load(std::memory_order_relaxed);
+    }
+
+    bool find(Key const &key, Value &value) {
+        std::size_t const hash = hasher(key);
+        hazards hp;
+        position pos;
+        if (!search(bucket_for(hash, hp), item_key(hash), &key, hp, pos)) {
+            return false;
+        }
+        item_node *const found = static_cast<item_node*>(pos.curr);
+        Value *v = found->value.load();
+        for (;;) {
+            hp.set(3, v);
+            Value *const again = found->value.load();
+            if (again == v) {
+                break;
+            }
+            v = again;
+        }
+        value = *v;
+        return true;
+    }
+
+    Value value_for(Key const &key, Value const &default_value = Value()) {
+        Value res;
+        return find(key, res) ? res : default_value;
+    }
+
+    // Returns false, leaving the map unchanged, if key is already present.
+    bool insert(Key const &key, Value const &value) {
+        return insert_or_assign(key, value, false);
+    }
+
+    void add_or_update_mapping(Key const &key, Value const &value) {
+        insert_or_assign(key, value, true);
+    }
+
+    // Returns false if key was not present.
+    bool remove_mapping(Key const &key) {
+        std::size_t const hash = hasher(key);
+        std::size_t const so_key = item_key(hash);
+        hazards hp;
+        node *const start = bucket_for(hash, hp);
+        position pos;
+        for (;;) {
+            if (!search(start, so_key, &key, hp, pos)) {
+                return false;
+            }
+            node *next = pos.curr->next.load();
+            if (is_marked(next)) {
+                continue;
+            }
+            if (!pos.curr->next.compare_exchange_strong(next, marked(next))) {
+                continue;
+            }
+            item_count.fetch_sub(1);
+            node *expected = pos.curr;
+            if (pos.prev->next.compare_exchange_strong(expected, next)) {
+                retire_item(pos.curr);
+            } else {
+                search(start, so_key, &key, hp, pos);
+            }
+            return true;
+        }
+    }
+};
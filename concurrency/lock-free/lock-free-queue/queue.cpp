@@ -1,18 +1,158 @@
 #include <atomic>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "../reclamation/atomic_counted_ptr.h"
+#include "../reclamation/node_pool.h"
+#include "../reclamation/reclaimers.h"
 
-template <typename T>
+// Michael-Scott queue over a pluggable reclaimer. head always points at a
+// dummy node; the value popped is the one in the node after it, which then
+// becomes the new dummy. Values are stored in the nodes, which come from a
+// node_pool, so push/try_pop do no allocation once the pool is warm. Only
+// nodes after head hold a constructed value.
+template <typename T, typename Reclaimer = split_reference_count>
 class lock_free_queue {
 private:
-    struct node;
+    struct node {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        std::atomic<node*> next;
+
+        node():
+            next(nullptr) {
+        }
 
-    struct counted_node_ptr {
-        int external_count;
-        node *ptr;
+        T &data() {
+            return *reinterpret_cast<T*>(&storage);
+        }
     };
 
-    std::atomic<counted_node_ptr> head;
-    std::atomic<counted_node_ptr> tail;
+    typedef node_pool<node> pool;
+
+    std::atomic<node*> head;
+    std::atomic<node*> tail;
+
+    // On success the popped value is the new head's; it stays valid while
+    // guard is alive and only the caller may touch it.
+    node *pop_node(typename Reclaimer::guard &guard) {
+        for (;;) {
+            node *old_head = guard.protect(head, 0);
+            node *const old_tail = tail.load();
+            node *const next = guard.protect(old_head->next, 1);
+            if (old_head != head.load()) {
+                continue;
+            }
+            if (!next) {
+                return nullptr;
+            }
+            if (old_head == old_tail) {
+                node *expected = old_tail;
+                tail.compare_exchange_strong(expected, next);
+                continue;
+            }
+            if (head.compare_exchange_strong(old_head, next)) {
+                Reclaimer::retire(old_head, &pool::deallocate);
+                return next;
+            }
+        }
+    }
+
+public:
+    lock_free_queue():
+        head(new (pool::allocate()) node), tail(head.load()) {
+    }
+
+    lock_free_queue(lock_free_queue const &) = delete;
+    lock_free_queue &operator=(lock_free_queue const &) = delete;
+
+    ~lock_free_queue() {
+        node *current = head.load();
+        while (current) {
+            node *const next = current->next.load();
+            if (current != head.load()) {
+                current->data().~T();
+            }
+            pool::deallocate(current);
+            current = next;
+        }
+    }
+
+    void push(T new_value) {
+        node *const new_node = new (pool::allocate()) node;
+        try {
+            new (&new_node->storage) T(std::move(new_value));
+        } catch (...) {
+            pool::deallocate(new_node);
+            throw;
+        }
+        typename Reclaimer::guard guard;
+        for (;;) {
+            node *old_tail = guard.protect(tail);
+            node *next = old_tail->next.load();
+            if (old_tail != tail.load()) {
+                continue;
+            }
+            if (next) {
+                // Help a push that linked its node but has not swung tail.
+                tail.compare_exchange_weak(old_tail, next);
+                continue;
+            }
+            if (old_tail->next.compare_exchange_weak(next, new_node)) {
+                tail.compare_exchange_strong(old_tail, new_node);
+                return;
+            }
+        }
+    }
+
+    bool try_pop(T &value) {
+        typename Reclaimer::guard guard;
+        node *const n = pop_node(guard);
+        if (!n) {
+            return false;
+        }
+        // n is unlinked and nothing else will destroy its value, so that
+        // happens even if the move throws.
+        try {
+            value = std::move(n->data());
+        } catch (...) {
+            n->data().~T();
+            throw;
+        }
+        n->data().~T();
+        return true;
+    }
+
+    std::unique_ptr<T> pop() {
+        typename Reclaimer::guard guard;
+        node *const n = pop_node(guard);
+        std::unique_ptr<T> res;
+        if (n) {
+            try {
+                res.reset(new T(std::move(n->data())));
+            } catch (...) {
+                n->data().~T();
+                throw;
+            }
+            n->data().~T();
+        }
+        return res;
+    }
+};
+
+// The original split-reference-counted queue, which frees nodes itself.
+template <typename T>
+class lock_free_queue<T, split_reference_count> {
+private:
+    struct node;
+
+    typedef counted_ptr<node> counted_node_ptr;
+
+    static_assert(atomic_counted_ptr<node>::is_always_lock_free,
+                  "split reference counting needs a lock-free counted pointer");
+
+    atomic_counted_ptr<node> head;
+    atomic_counted_ptr<node> tail;
 
     struct node_counter {
         unsigned internal_count:30;
@@ -22,16 +162,17 @@ private:
     struct node {
         std::atomic<T*> data;
         std::atomic<node_counter> count;
-        std::atomic<counted_node_ptr> next;
+        atomic_counted_ptr<node> next;
 
-        node () {
+        node ():
+            data(nullptr) {
             node_counter new_count;
             new_count.internal_count = 0;
             new_count.external_counters = 2;
             count.store(new_count);
 
-            next.ptr = nullptr;
-            next.external_count = 0;
+            counted_node_ptr const no_next = {0, nullptr};
+            next.store(no_next);
         }
 
         void release_ref() {
@@ -51,7 +192,7 @@ private:
     };
 
     static void increase_external_count(
-            std::atomic<counted_node_ptr> &counter,
+            atomic_counted_ptr<node> &counter,
             counted_node_ptr &old_counter) {
         counted_node_ptr new_counter;
 
@@ -94,6 +235,22 @@ private:
             current_tail_ptr->release_ref();
     }
 public:
+    lock_free_queue() {
+        counted_node_ptr dummy;
+        dummy.ptr = new node;
+        dummy.external_count = 1;
+        head.store(dummy);
+        tail.store(dummy);
+    }
+
+    lock_free_queue(lock_free_queue const &) = delete;
+    lock_free_queue &operator=(lock_free_queue const &) = delete;
+
+    ~lock_free_queue() {
+        while (pop()) ;
+        delete head.load().ptr;
+    }
+
     void push(T new_value) {
         std::unique_ptr<T> new_data(new T(new_value));
         counted_node_ptr new_next;
@@ -107,8 +264,8 @@ public:
             T *old_data = nullptr;
             if (old_tail.ptr->data.compare_exchange_strong(
                         old_data, new_data.get())) {
-                counted_node_ptr old_next = {0};
-                if (old_tail.ptr->next.compare_exchange_strong(
+                counted_node_ptr old_next = {0, nullptr};
+                if (!old_tail.ptr->next.compare_exchange_strong(
                             old_next, new_next)) {
                     delete new_next.ptr;
                     new_next = old_next;
@@ -117,7 +274,7 @@ public:
                 new_data.release();
                 break;
             } else {
-                counted_node_ptr old_next = {0};
+                counted_node_ptr old_next = {0, nullptr};
                 if (old_tail.ptr->next.compare_exchange_strong(
                             old_next, new_next)) {
                     old_next = new_next;
@@ -128,6 +285,15 @@ public:
         }
     }
     
+    bool try_pop(T &value) {
+        std::unique_ptr<T> const res = pop();
+        if (!res) {
+            return false;
+        }
+        value = std::move(*res);
+        return true;
+    }
+
     std::unique_ptr<T> pop() {
         counted_node_ptr old_head = head.load(std::memory_order_relaxed);
         for (;;) {
@@ -139,7 +305,10 @@ public:
             }
             counted_node_ptr next = ptr->next.load();
             if (head.compare_exchange_strong(old_head, next)) {
-                T *const res = ptr->data.exchange(nullptr);
+                // data is left set: a push still holding a count on ptr
+                // from when it was the tail must not be able to store a
+                // value into it after it has been popped.
+                T *const res = ptr->data.load();
                 free_external_counter(old_head);
                 return std::unique_ptr<T>(res);
             }
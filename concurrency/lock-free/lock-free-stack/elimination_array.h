@@ -0,0 +1,120 @@
+#ifndef ELIMINATION_ARRAY_H
+#define ELIMINATION_ARRAY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Elimination backoff for stacks after Hendler, Shavit and Yerushalmi. A
+// push that lost a CAS on head offers its node in a random slot; a pop
+// that lost one looks for an offer in a random slot and takes it. The pair
+// has then happened back to back without touching head, which is a valid
+// linearization of a stack. A node only ever passes through here while it
+// is private to the pusher, so the popper owns it outright and no
+// reclamation is involved.
+//
+// The slots in use shrink when a thread waits in one without meeting a
+// partner and grow when a thread finds its slot busy, so the array spreads
+// out under heavy contention and stays dense enough for pairs to meet
+// under light contention.
+template <typename Node>
+class elimination_array {
+private:
+    static std::size_t const cache_line = 64;
+    static unsigned const slot_count = 16;
+    static unsigned const wait_spins = 128;
+
+    struct slot {
+        std::atomic<Node*> offer;
+        char pad[cache_line - sizeof(std::atomic<Node*>)];
+    };
+
+    slot slots[slot_count];
+    std::atomic<unsigned> range;
+
+    // Left in a slot by the popper until the pusher sees it and clears it.
+    static Node *taken() {
+        return reinterpret_cast<Node*>(std::uintptr_t(1));
+    }
+
+    slot &random_slot() {
+        thread_local static std::uint32_t seed = std::uint32_t(
+            reinterpret_cast<std::uintptr_t>(&seed) >> 4) | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return slots[seed % range.load(std::memory_order_relaxed)];
+    }
+
+    void grow() {
+        unsigned const r = range.load(std::memory_order_relaxed);
+        if (r < slot_count) {
+            range.store(r + 1, std::memory_order_relaxed);
+        }
+    }
+
+    void shrink() {
+        unsigned const r = range.load(std::memory_order_relaxed);
+        if (r > 1) {
+            range.store(r - 1, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    elimination_array():
+        range(1) {
+        for (unsigned i = 0; i < slot_count; ++i) {
+            slots[i].offer.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    elimination_array(elimination_array const &) = delete;
+    elimination_array &operator=(elimination_array const &) = delete;
+
+    // Returns true if a pop took n; otherwise n is still the caller's.
+    bool offer(Node *n) {
+        slot &s = random_slot();
+        Node *expected = nullptr;
+        if (!s.offer.compare_exchange_strong(expected, n,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+            grow();
+            return false;
+        }
+        for (unsigned i = 0; i < wait_spins; ++i) {
+            if (s.offer.load(std::memory_order_relaxed) != n) {
+                s.offer.store(nullptr, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        expected = n;
+        if (s.offer.compare_exchange_strong(expected, nullptr,
+                                            std::memory_order_relaxed)) {
+            shrink();
+            return false;
+        }
+        s.offer.store(nullptr, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Returns a node some push offered, or nullptr.
+    Node *take() {
+        slot &s = random_slot();
+        for (unsigned i = 0; i < wait_spins; ++i) {
+            Node *n = s.offer.load(std::memory_order_relaxed);
+            if (n && n != taken()) {
+                if (s.offer.compare_exchange_strong(n, taken(),
+                                                    std::memory_order_acquire,
+                                                    std::memory_order_relaxed)) {
+                    return n;
+                }
+                grow();
+                return nullptr;
+            }
+        }
+        shrink();
+        return nullptr;
+    }
+};
+
+#endif
@@ -1,4 +1,4 @@
-#include "hazard_pointer.h"
+#include "../../reclamation/hazard_pointer.h"
 #include <atomic>
 #include <memory>
 
@@ -39,12 +39,7 @@ public:
         std::shared_ptr<T> res;
         if (old_head) {
             res.swap(old_head->data);
-            if (outstanding_hazard_pointers_for(old_head)) {
-                reclaim_later(old_head);
-            } else {
-                delete old_head;
-            }
-            delete_nodes_with_no_hazards();
+            reclaim_later(old_head);
         }
         return res;
     }
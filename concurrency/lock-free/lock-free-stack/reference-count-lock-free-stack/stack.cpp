@@ -1,15 +1,16 @@
 #include <atomic>
 #include <memory>
+#include "../../reclamation/atomic_counted_ptr.h"
 
 template <typename T>
 class lock_free_stack {
 private:
     struct node;
 
-    struct counted_node_ptr {
-        int external_count;
-        node *ptr;
-    };
+    typedef counted_ptr<node> counted_node_ptr;
+
+    static_assert(atomic_counted_ptr<node>::is_always_lock_free,
+                  "split reference counting needs a lock-free counted pointer");
 
     struct node {
         std::shared_ptr<T> data;
@@ -22,7 +23,7 @@ private:
         }
     };
 
-    std::atomic<counted_node_ptr> head;
+    atomic_counted_ptr<node> head;
 
     void increase_head_count(counted_node_ptr &old_counter) {
         counted_node_ptr new_counter;
@@ -1,79 +1,160 @@
 #include <atomic>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "../reclamation/node_pool.h"
+#include "../reclamation/reclaimers.h"
+#include "elimination_array.h"
 
-template <typename T>
+// The value lives in the node and nodes come from a node_pool, so
+// push/try_pop do no allocation once the pool is warm. The value is moved
+// out and destroyed before the node is retired; the reclaimer only ever
+// hands back raw memory.
+//
+// With Eliminate set, a push or pop that loses the race for head tries to
+// cancel out against an opposite operation in an elimination_array before
+// retrying, which keeps throughput up when many threads hammer one stack.
+template <typename T, typename Reclaimer = threads_in_pop_reclaimer,
+          bool Eliminate = false>
 class lock_free_stack {
 private:
     struct node {
-        std::shared_ptr<T> data;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
         node *next;
 
-        node (T const &data_):
-            data(std::make_shared<T>(data_)) {
+        T &data() {
+            return *reinterpret_cast<T*>(&storage);
         }
     };
 
+    typedef node_pool<node> pool;
+
+    struct no_elimination {
+    };
+
     std::atomic<node*> head;
-    std::atomic<unsigned> threads_in_pop;
-    std::atomic<node*> to_be_deleted;
-
-    static void delete_nodes(node *nodes) {
-        while (nodes) {
-            node *next = nodes->next;
-            delete nodes;
-            nodes = next;
+    typename std::conditional<Eliminate, elimination_array<node>,
+                              no_elimination>::type elimination;
+
+    static bool offer(no_elimination &, node *) {
+        return false;
+    }
+
+    static bool offer(elimination_array<node> &e, node *n) {
+        return e.offer(n);
+    }
+
+    static node *take(no_elimination &) {
+        return nullptr;
+    }
+
+    static node *take(elimination_array<node> &e) {
+        return e.take();
+    }
+
+    template <typename U>
+    void push_value(U &&value) {
+        node *const new_node = new (pool::allocate()) node;
+        try {
+            new (&new_node->storage) T(std::forward<U>(value));
+        } catch (...) {
+            pool::deallocate(new_node);
+            throw;
+        }
+        new_node->next = head.load();
+        while (!head.compare_exchange_strong(new_node->next, new_node)) {
+            if (offer(elimination, new_node)) {
+                return;
+            }
         }
     }
 
-    void try_reclaim(node *old_head) {
-        if (threads_in_pop == 1) {
-            node *nodes_to_delete = to_be_deleted.exchange(nullptr);
-            if (!--threads_in_pop) {
-                delete_nodes(nodes_to_delete);
-            } else if (nodes_to_delete) {
-                chain_pending_nodes(nodes_to_delete);
+    // The popped node stays valid while guard is alive. eliminated is set
+    // if it came straight from a push rather than from head, in which case
+    // nobody else can reach it.
+    node *pop_node(typename Reclaimer::guard &guard, bool &eliminated) {
+        eliminated = false;
+        node *old_head = guard.protect(head);
+        while (old_head &&
+             !head.compare_exchange_strong(old_head, old_head->next)) {
+            if (node *const n = take(elimination)) {
+                eliminated = true;
+                return n;
             }
-            delete old_head;
-        } else {
-            chain_pending_node(old_head);
-            --threads_in_pop;
+            old_head = guard.protect(head);
         }
+        return old_head;
     }
 
-    void chain_pending_nodes(node *nodes) {
-        node *last = nodes;
-        while (node *const next = last->next) {
-            last = next;
+    static void retire_node(node *n, bool eliminated) {
+        n->data().~T();
+        if (eliminated) {
+            pool::deallocate(n);
+        } else {
+            Reclaimer::retire(n, &pool::deallocate);
         }
-        chain_pending_nodes(nodes, last);
     }
 
-    void chain_pending_nodes(node *first, node *last) {
-        last->next = to_be_deleted;
-        while (!to_be_deleted.compare_exchange_weak(last->next, first)) ;
+public:
+    lock_free_stack():
+        head(nullptr) {
     }
 
-    void chain_pending_node(node *n) {
-        chain_pending_nodes(n, n);
+    lock_free_stack(lock_free_stack const &) = delete;
+    lock_free_stack &operator=(lock_free_stack const &) = delete;
+
+    ~lock_free_stack() {
+        node *current = head.load();
+        while (current) {
+            node *const next = current->next;
+            current->data().~T();
+            pool::deallocate(current);
+            current = next;
+        }
     }
 
-public:
     void push(T const &data) {
-        node *const new_node = new node(data);
-        new_node->next = head.load();
-        while (!head.compare_exchange_weak(new_node->next, new_node)) ;
+        push_value(data);
     }
-    
+
+    void push(T &&data) {
+        push_value(std::move(data));
+    }
+
+    bool try_pop(T &value) {
+        typename Reclaimer::guard guard;
+        bool eliminated;
+        node *const old_head = pop_node(guard, eliminated);
+        if (!old_head) {
+            return false;
+        }
+        // The node is ours alone now, so it is retired even if the move
+        // throws.
+        try {
+            value = std::move(old_head->data());
+        } catch (...) {
+            retire_node(old_head, eliminated);
+            throw;
+        }
+        retire_node(old_head, eliminated);
+        return true;
+    }
+
     std::shared_ptr<T> pop() {
-        ++threads_in_pop;
-        node *old_head = head.load();
-        while (old_head && 
-             !head.compare_exchange_weak(old_head, old_head->next));
+        typename Reclaimer::guard guard;
+        bool eliminated;
+        node *const old_head = pop_node(guard, eliminated);
         std::shared_ptr<T> res;
         if (old_head) {
-            res.swap(old_head->data);
+            try {
+                res = std::make_shared<T>(std::move(old_head->data()));
+            } catch (...) {
+                retire_node(old_head, eliminated);
+                throw;
+            }
+            retire_node(old_head, eliminated);
         }
-        try_reclaim(old_head);
         return res;
     }
 };
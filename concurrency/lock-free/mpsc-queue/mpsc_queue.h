@@ -0,0 +1,155 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "../../thread-pool/event_count.h"
+#include "../reclamation/node_pool.h"
+
+// Unbounded multi-producer single-consumer queue after Vyukov. A push is
+// one exchange on head plus a store linking the previous node, so
+// producers never retry; the consumer walks the next pointers from its
+// private tail without any atomic read-modify-write. Like
+// lock_free_queue, tail is a dummy whose successor holds the next value.
+//
+// A producer preempted between the exchange and the link hides its node
+// and everything pushed after it until it resumes, so try_pop may report
+// empty while other pushes have completed. Since only the consumer frees
+// nodes no reclaimer is needed.
+template <typename T>
+class mpsc_queue {
+private:
+    struct node {
+        std::atomic<node*> next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        node():
+            next(nullptr) {
+        }
+
+        T &data() {
+            return *reinterpret_cast<T*>(&storage);
+        }
+    };
+
+    typedef node_pool<node> pool;
+
+    static std::size_t const cache_line = 64;
+
+    char pad0[cache_line];
+    std::atomic<node*> head;
+    char pad1[cache_line - sizeof(std::atomic<node*>)];
+    node *tail;
+    char pad2[cache_line - sizeof(node*)];
+
+    template <typename U>
+    void push_value(U &&value) {
+        node *const new_node = new (pool::allocate()) node;
+        try {
+            new (&new_node->storage) T(std::forward<U>(value));
+        } catch (...) {
+            pool::deallocate(new_node);
+            throw;
+        }
+        node *const prev = head.exchange(new_node, std::memory_order_acq_rel);
+        prev->next.store(new_node, std::memory_order_release);
+    }
+
+public:
+    mpsc_queue():
+        head(new (pool::allocate()) node), tail(head.load()) {
+    }
+
+    mpsc_queue(mpsc_queue const &) = delete;
+    mpsc_queue &operator=(mpsc_queue const &) = delete;
+
+    ~mpsc_queue() {
+        node *current = tail;
+        while (current) {
+            node *const next = current->next.load();
+            if (current != tail) {
+                current->data().~T();
+            }
+            pool::deallocate(current);
+            current = next;
+        }
+    }
+
+    void push(T const &value) {
+        push_value(value);
+    }
+
+    void push(T &&value) {
+        push_value(std::move(value));
+    }
+
+    // Consumer only.
+    bool try_pop(T &value) {
+        node *const next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        value = std::move(next->data());
+        next->data().~T();
+        pool::deallocate(tail);
+        tail = next;
+        return true;
+    }
+
+    // Consumer only.
+    bool empty() const {
+        return !tail->next.load(std::memory_order_acquire);
+    }
+};
+
+// mpsc_queue whose consumer sleeps while it is empty.
+template <typename T>
+class blocking_mpsc_queue {
+private:
+    // Yields this many times before going to sleep, which is much
+    // cheaper than a wakeup when the other side is only briefly behind.
+    static unsigned const spin_count = 64;
+
+    mpsc_queue<T> q;
+    event_count not_empty;
+
+public:
+    void push(T const &value) {
+        q.push(value);
+        not_empty.notify();
+    }
+
+    void push(T &&value) {
+        q.push(std::move(value));
+        not_empty.notify();
+    }
+
+    bool try_pop(T &value) {
+        return q.try_pop(value);
+    }
+
+    void wait_and_pop(T &value) {
+        for (unsigned spins = 0; !q.try_pop(value); ++spins) {
+            if (spins < spin_count) {
+                std::this_thread::yield();
+                continue;
+            }
+            event_count::key const k = not_empty.prepare_wait();
+            if (q.try_pop(value)) {
+                not_empty.cancel_wait();
+                return;
+            }
+            not_empty.commit_wait(k);
+        }
+    }
+
+    bool empty() const {
+        return q.empty();
+    }
+};
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef ATOMIC_COUNTED_PTR_H
+#define ATOMIC_COUNTED_PTR_H
+
+#include <atomic>
+#include <cstdint>
+
+// The pointer plus external count used by split reference counting.
+template <typename Node>
+struct counted_ptr {
+    int external_count;
+    Node *ptr;
+};
+
+// std::atomic<counted_ptr<Node>> is 16 bytes on 64-bit targets and quietly
+// falls back to a lock unless the compiler can prove double-width CAS is
+// available, which GCC and Clang no longer do even with -mcx16. This
+// provides the same interface without ever taking a lock:
+//
+//  - x86-64: cmpxchg16b on an aligned pair of words.
+//  - other 64-bit targets: the count goes in the upper 16 bits of the
+//    pointer, which user-space addresses leave clear (48-bit VA), so a
+//    plain 64-bit atomic suffices. Counts must stay below 65536.
+//  - 32-bit targets: counted_ptr fits in 8 bytes and std::atomic is used
+//    directly, checked to be lock-free at compile time where C++17 allows.
+//
+// Define COUNTED_PTR_FORCE_TAGGED to use the packed form on x86-64 too.
+// cmpxchg16b is a full barrier, so that form ignores memory_order
+// arguments.
+
+#if defined(__x86_64__) && !defined(COUNTED_PTR_FORCE_TAGGED)
+
+template <typename Node>
+class atomic_counted_ptr {
+private:
+    struct alignas(16) words {
+        std::uint64_t count;
+        std::uint64_t ptr;
+    };
+
+    words value;
+
+    static words pack(counted_ptr<Node> const &p) {
+        words w;
+        w.count = std::uint64_t(std::uint32_t(p.external_count));
+        w.ptr = std::uint64_t(reinterpret_cast<std::uintptr_t>(p.ptr));
+        return w;
+    }
+
+    static counted_ptr<Node> unpack(words const &w) {
+        counted_ptr<Node> p;
+        p.external_count = int(std::uint32_t(w.count));
+        p.ptr = reinterpret_cast<Node*>(std::uintptr_t(w.ptr));
+        return p;
+    }
+
+    // On failure expected is updated with the current value.
+    bool cas(words &expected, words const &desired) {
+        bool ok;
+        __asm__ __volatile__(
+            "lock cmpxchg16b %1\n\t"
+            "sete %0"
+            : "=q"(ok), "+m"(value), "+a"(expected.count), "+d"(expected.ptr)
+            : "b"(desired.count), "c"(desired.ptr)
+            : "cc", "memory");
+        return ok;
+    }
+
+public:
+    static bool const is_always_lock_free = true;
+
+    atomic_counted_ptr(atomic_counted_ptr const &) = delete;
+    atomic_counted_ptr &operator=(atomic_counted_ptr const &) = delete;
+
+    atomic_counted_ptr() {
+        value.count = 0;
+        value.ptr = 0;
+    }
+
+    explicit atomic_counted_ptr(counted_ptr<Node> const &p):
+        value(pack(p)) {
+    }
+
+    bool is_lock_free() const {
+        return true;
+    }
+
+    // cmpxchg16b always writes, so a load is a CAS that either fails and
+    // returns the current value or succeeds by swapping it with itself.
+    counted_ptr<Node> load(
+            std::memory_order = std::memory_order_seq_cst) const {
+        words expected = {0, 0};
+        const_cast<atomic_counted_ptr*>(this)->cas(expected, expected);
+        return unpack(expected);
+    }
+
+    void store(counted_ptr<Node> const &desired,
+               std::memory_order = std::memory_order_seq_cst) {
+        // Reading value directly could tear; a guess that fails costs no
+        // more than a load would and hands back the current value.
+        words const d = pack(desired);
+        words expected = {0, 0};
+        while (!cas(expected, d)) ;
+    }
+
+    bool compare_exchange_strong(counted_ptr<Node> &expected,
+                                 counted_ptr<Node> const &desired,
+                                 std::memory_order = std::memory_order_seq_cst,
+                                 std::memory_order = std::memory_order_seq_cst) {
+        words e = pack(expected);
+        if (cas(e, pack(desired))) {
+            return true;
+        }
+        expected = unpack(e);
+        return false;
+    }
+
+    bool compare_exchange_weak(counted_ptr<Node> &expected,
+                               counted_ptr<Node> const &desired,
+                               std::memory_order s = std::memory_order_seq_cst,
+                               std::memory_order f = std::memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired, s, f);
+    }
+};
+
+#elif UINTPTR_MAX > 0xffffffffu
+
+template <typename Node>
+class atomic_counted_ptr {
+private:
+    static unsigned const pointer_bits = 48;
+    static std::uint64_t const pointer_mask =
+        (std::uint64_t(1) << pointer_bits) - 1;
+
+    std::atomic<std::uint64_t> value;
+
+    static std::uint64_t pack(counted_ptr<Node> const &p) {
+        return (std::uint64_t(std::uint16_t(p.external_count)) << pointer_bits) |
+            (std::uint64_t(reinterpret_cast<std::uintptr_t>(p.ptr)) &
+             pointer_mask);
+    }
+
+    static counted_ptr<Node> unpack(std::uint64_t w) {
+        counted_ptr<Node> p;
+        p.external_count = int(w >> pointer_bits);
+        p.ptr = reinterpret_cast<Node*>(std::uintptr_t(w & pointer_mask));
+        return p;
+    }
+
+public:
+    static bool const is_always_lock_free = ATOMIC_LLONG_LOCK_FREE == 2;
+
+    atomic_counted_ptr(atomic_counted_ptr const &) = delete;
+    atomic_counted_ptr &operator=(atomic_counted_ptr const &) = delete;
+
+    atomic_counted_ptr():
+        value(0) {
+    }
+
+    explicit atomic_counted_ptr(counted_ptr<Node> const &p):
+        value(pack(p)) {
+    }
+
+    bool is_lock_free() const {
+        return value.is_lock_free();
+    }
+
+    counted_ptr<Node> load(
+            std::memory_order order = std::memory_order_seq_cst) const {
+        return unpack(value.load(order));
+    }
+
+    void store(counted_ptr<Node> const &desired,
+               std::memory_order order = std::memory_order_seq_cst) {
+        value.store(pack(desired), order);
+    }
+
+    bool compare_exchange_strong(counted_ptr<Node> &expected,
+                                 counted_ptr<Node> const &desired,
+                                 std::memory_order s = std::memory_order_seq_cst,
+                                 std::memory_order f = std::memory_order_seq_cst) {
+        std::uint64_t e = pack(expected);
+        if (value.compare_exchange_strong(e, pack(desired), s, f)) {
+            return true;
+        }
+        expected = unpack(e);
+        return false;
+    }
+
+    bool compare_exchange_weak(counted_ptr<Node> &expected,
+                               counted_ptr<Node> const &desired,
+                               std::memory_order s = std::memory_order_seq_cst,
+                               std::memory_order f = std::memory_order_seq_cst) {
+        std::uint64_t e = pack(expected);
+        if (value.compare_exchange_weak(e, pack(desired), s, f)) {
+            return true;
+        }
+        expected = unpack(e);
+        return false;
+    }
+};
+
+#else
+
+template <typename Node>
+class atomic_counted_ptr: public std::atomic<counted_ptr<Node>> {
+public:
+    static bool const is_always_lock_free = ATOMIC_LLONG_LOCK_FREE == 2;
+#if __cplusplus >= 201703L
+    static_assert(std::atomic<counted_ptr<Node>>::is_always_lock_free,
+                  "counted_ptr must be lock-free on this target");
+#endif
+
+    atomic_counted_ptr() {
+        counted_ptr<Node> const empty = {0, nullptr};
+        this->store(empty);
+    }
+};
+
+#endif
+
+#endif
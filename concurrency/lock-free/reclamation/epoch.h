@@ -0,0 +1,272 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "retired_node.h"
+
+// Epoch-based reclamation. A thread announces the global epoch when it
+// enters a critical region; the epoch only advances once every thread
+// inside a region has announced the current one. A node retired in epoch e
+// can no longer be reached by anyone once the global epoch reaches e + 2.
+// Readers pay one store and a fence per region rather than one per node,
+// but a thread stalled inside a region holds up all reclamation.
+
+// One per thread that has entered a region. Like hazard records these are
+// never unlinked, only reused.
+struct epoch_record {
+    // Announced epoch << 1, with the low bit set while inside a region.
+    std::atomic<std::uint64_t> state;
+    std::atomic<bool> in_use;
+    epoch_record *next;
+
+    epoch_record():
+        state(0), in_use(true), next(nullptr) {
+    }
+};
+
+class epoch_domain {
+private:
+    std::atomic<std::uint64_t> global_epoch;
+    std::atomic<epoch_record*> records;
+
+    struct orphan_batch {
+        std::uint64_t epoch;
+        std::vector<retired_node> nodes;
+    };
+
+    std::mutex orphans_mutex;
+    std::vector<orphan_batch> orphans;
+    std::atomic<bool> has_orphans;
+
+    static void free_nodes(std::vector<retired_node> &nodes) {
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].deleter(nodes[i].data);
+        }
+        nodes.clear();
+    }
+
+public:
+    epoch_domain(epoch_domain const &) = delete;
+    epoch_domain &operator=(epoch_domain const &) = delete;
+
+    epoch_domain():
+        global_epoch(0), records(nullptr), has_orphans(false) {
+    }
+
+    ~epoch_domain() {
+        for (std::size_t i = 0; i < orphans.size(); ++i) {
+            free_nodes(orphans[i].nodes);
+        }
+        epoch_record *current = records.load();
+        while (current) {
+            epoch_record *const next = current->next;
+            delete current;
+            current = next;
+        }
+    }
+
+    epoch_record *acquire_record() {
+        for (epoch_record *r = records.load(); r; r = r->next) {
+            bool expected = false;
+            if (!r->in_use.load(std::memory_order_relaxed) &&
+                r->in_use.compare_exchange_strong(expected, true)) {
+                return r;
+            }
+        }
+        epoch_record *const r = new epoch_record;
+        r->next = records.load();
+        while (!records.compare_exchange_weak(r->next, r)) ;
+        return r;
+    }
+
+    void release_record(epoch_record *r) {
+        r->state.store(0, std::memory_order_release);
+        r->in_use.store(false, std::memory_order_release);
+    }
+
+    std::uint64_t epoch() const {
+        return global_epoch.load(std::memory_order_acquire);
+    }
+
+    void enter(epoch_record *r) {
+        r->state.store((global_epoch.load(std::memory_order_relaxed) << 1) | 1,
+                       std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void leave(epoch_record *r) {
+        r->state.store(0, std::memory_order_release);
+    }
+
+    // Moves the global epoch on if every thread inside a region has seen
+    // the current one. Returns the epoch afterwards.
+    std::uint64_t try_advance() {
+        std::uint64_t e = global_epoch.load();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (epoch_record *r = records.load(); r; r = r->next) {
+            std::uint64_t const s = r->state.load(std::memory_order_acquire);
+            if ((s & 1) && (s >> 1) != e) {
+                return e;
+            }
+        }
+        if (global_epoch.compare_exchange_strong(e, e + 1)) {
+            ++e;
+        }
+        if (has_orphans.load(std::memory_order_relaxed)) {
+            free_orphans(e);
+        }
+        return e;
+    }
+
+    void adopt(std::uint64_t epoch, std::vector<retired_node> &nodes) {
+        if (nodes.empty()) {
+            return;
+        }
+        orphan_batch batch;
+        batch.epoch = epoch;
+        batch.nodes.swap(nodes);
+        std::lock_guard<std::mutex> lk(orphans_mutex);
+        orphans.push_back(std::move(batch));
+        has_orphans.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    void free_orphans(std::uint64_t e) {
+        std::vector<retired_node> ready;
+        {
+            std::unique_lock<std::mutex> lk(orphans_mutex, std::try_to_lock);
+            if (!lk.owns_lock()) {
+                return;
+            }
+            std::size_t kept = 0;
+            for (std::size_t i = 0; i < orphans.size(); ++i) {
+                if (orphans[i].epoch + 2 <= e) {
+                    ready.insert(ready.end(), orphans[i].nodes.begin(),
+                                 orphans[i].nodes.end());
+                } else {
+                    std::swap(orphans[kept++], orphans[i]);
+                }
+            }
+            orphans.resize(kept);
+            has_orphans.store(kept != 0, std::memory_order_relaxed);
+        }
+        free_nodes(ready);
+    }
+};
+
+inline epoch_domain &default_epoch_domain() {
+    static epoch_domain domain;
+    return domain;
+}
+
+// A thread's epoch record and its retired nodes, bagged by the epoch they
+// were retired in. Only three bags are needed: when a bag's slot comes
+// round again its epoch is at least three behind.
+class epoch_thread_state {
+private:
+    static unsigned const bag_count = 3;
+    static unsigned const advance_interval = 64;
+
+    epoch_domain &domain;
+    epoch_record *record;
+    unsigned nesting;
+    unsigned retires_since_advance;
+    std::uint64_t bag_epoch[bag_count];
+    std::vector<retired_node> bags[bag_count];
+
+    void free_bag(unsigned i) {
+        for (std::size_t j = 0; j < bags[i].size(); ++j) {
+            bags[i][j].deleter(bags[i][j].data);
+        }
+        bags[i].clear();
+    }
+
+    void free_expired(std::uint64_t e) {
+        for (unsigned i = 0; i < bag_count; ++i) {
+            if (!bags[i].empty() && bag_epoch[i] + 2 <= e) {
+                free_bag(i);
+            }
+        }
+    }
+
+public:
+    epoch_thread_state(epoch_thread_state const &) = delete;
+    epoch_thread_state &operator=(epoch_thread_state const &) = delete;
+
+    explicit epoch_thread_state(epoch_domain &domain_):
+        domain(domain_), record(domain_.acquire_record()), nesting(0),
+        retires_since_advance(0) {
+        for (unsigned i = 0; i < bag_count; ++i) {
+            bag_epoch[i] = 0;
+        }
+    }
+
+    ~epoch_thread_state() {
+        domain.release_record(record);
+        std::uint64_t const e = domain.try_advance();
+        free_expired(e);
+        for (unsigned i = 0; i < bag_count; ++i) {
+            domain.adopt(bag_epoch[i], bags[i]);
+        }
+    }
+
+    // Regions nest; only the outermost one announces an epoch.
+    void enter() {
+        if (!nesting++) {
+            domain.enter(record);
+        }
+    }
+
+    void leave() {
+        if (!--nesting) {
+            domain.leave(record);
+        }
+    }
+
+    void retire(void *data, void (*deleter)(void*)) {
+        std::uint64_t e = domain.epoch();
+        if (++retires_since_advance >= advance_interval) {
+            retires_since_advance = 0;
+            e = domain.try_advance();
+            free_expired(e);
+        }
+        unsigned const i = unsigned(e % bag_count);
+        if (bag_epoch[i] != e) {
+            // The slot's last user was epoch e - 3 or earlier.
+            free_bag(i);
+            bag_epoch[i] = e;
+        }
+        retired_node const node = {data, deleter};
+        bags[i].push_back(node);
+    }
+};
+
+inline epoch_thread_state &epoch_state_for_current_thread() {
+    thread_local static epoch_thread_state state(default_epoch_domain());
+    return state;
+}
+
+class epoch_guard {
+public:
+    epoch_guard(epoch_guard const &) = delete;
+    epoch_guard &operator=(epoch_guard const &) = delete;
+
+    epoch_guard() {
+        epoch_state_for_current_thread().enter();
+    }
+
+    ~epoch_guard() {
+        epoch_state_for_current_thread().leave();
+    }
+};
+
+template <typename T>
+void retire_in_epoch(T *data) {
+    epoch_state_for_current_thread().retire(data, &do_delete<T>);
+}
+
+#endif
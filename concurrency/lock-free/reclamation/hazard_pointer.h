@@ -0,0 +1,245 @@
+#ifndef HAZARD_POINTER_H
+#define HAZARD_POINTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "retired_node.h"
+
+// Hazard pointers each thread may hold at once; structures that need to
+// protect more than one node at a time (e.g. a list's prev and curr) use
+// the extra slots, and guards that nest take slots of their own.
+unsigned const hazard_pointers_per_thread = 8;
+
+// One per thread that has used hazard pointers. Records are only ever
+// pushed onto the domain's list, never unlinked, so scanners can walk it
+// without locks; a record freed by an exiting thread is reused by the next
+// thread that needs one.
+struct hazard_record {
+    std::atomic<bool> active;
+    std::atomic<void*> pointers[hazard_pointers_per_thread];
+    hazard_record *next;
+
+    hazard_record():
+        active(true), next(nullptr) {
+        for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+            pointers[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+};
+
+class hazard_pointer_domain {
+private:
+    std::atomic<hazard_record*> records;
+    std::atomic<unsigned> record_count;
+
+    // Nodes still protected when their retiring thread exited; the next
+    // scan on any thread adopts them.
+    std::mutex orphans_mutex;
+    std::vector<retired_node> orphans;
+    std::atomic<bool> has_orphans;
+
+    static std::size_t const min_scan_batch = 64;
+
+public:
+    hazard_pointer_domain(hazard_pointer_domain const &) = delete;
+    hazard_pointer_domain &operator=(hazard_pointer_domain const &) = delete;
+
+    hazard_pointer_domain():
+        records(nullptr), record_count(0), has_orphans(false) {
+    }
+
+    ~hazard_pointer_domain() {
+        for (std::size_t i = 0; i < orphans.size(); ++i) {
+            orphans[i].deleter(orphans[i].data);
+        }
+        hazard_record *current = records.load();
+        while (current) {
+            hazard_record *const next = current->next;
+            delete current;
+            current = next;
+        }
+    }
+
+    hazard_record *acquire_record() {
+        for (hazard_record *r = records.load(); r; r = r->next) {
+            bool expected = false;
+            if (!r->active.load(std::memory_order_relaxed) &&
+                r->active.compare_exchange_strong(expected, true)) {
+                return r;
+            }
+        }
+        hazard_record *const r = new hazard_record;
+        r->next = records.load();
+        while (!records.compare_exchange_weak(r->next, r)) ;
+        record_count.fetch_add(1, std::memory_order_relaxed);
+        return r;
+    }
+
+    void release_record(hazard_record *r) {
+        for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+            r->pointers[i].store(nullptr);
+        }
+        r->active.store(false);
+    }
+
+    // Scanning once a retire list holds about twice as many nodes as there
+    // are hazard pointers means at least half of each batch is freed, so
+    // each retired node costs O(1) amortized.
+    std::size_t scan_threshold() const {
+        std::size_t const hazards =
+            std::size_t(record_count.load(std::memory_order_relaxed)) *
+            hazard_pointers_per_thread;
+        return std::max(2 * hazards, std::size_t(min_scan_batch));
+    }
+
+    bool is_hazard(void *p) const {
+        for (hazard_record *r = records.load(); r; r = r->next) {
+            for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+                if (r->pointers[i].load() == p) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Frees every node in retired that no hazard pointer refers to; the
+    // rest stay in retired for a later scan. hazards is scratch space.
+    void scan(std::vector<retired_node> &retired,
+              std::vector<void*> &hazards) {
+        if (has_orphans.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lk(orphans_mutex);
+            retired.insert(retired.end(), orphans.begin(), orphans.end());
+            orphans.clear();
+            has_orphans.store(false, std::memory_order_relaxed);
+        }
+
+        hazards.clear();
+        for (hazard_record *r = records.load(); r; r = r->next) {
+            for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+                void *const p = r->pointers[i].load();
+                if (p) {
+                    hazards.push_back(p);
+                }
+            }
+        }
+        std::sort(hazards.begin(), hazards.end());
+
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < retired.size(); ++i) {
+            if (std::binary_search(hazards.begin(), hazards.end(),
+                                   retired[i].data)) {
+                retired[kept++] = retired[i];
+            } else {
+                retired[i].deleter(retired[i].data);
+            }
+        }
+        retired.resize(kept);
+    }
+
+    void adopt(std::vector<retired_node> &retired) {
+        if (retired.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(orphans_mutex);
+        orphans.insert(orphans.end(), retired.begin(), retired.end());
+        has_orphans.store(true, std::memory_order_relaxed);
+        retired.clear();
+    }
+};
+
+inline hazard_pointer_domain &default_hazard_pointer_domain() {
+    static hazard_pointer_domain domain;
+    return domain;
+}
+
+// A thread's hazard record and retire list, handed back to the domain when
+// the thread exits.
+class hazard_thread_state {
+private:
+    hazard_pointer_domain &domain;
+    hazard_record *record;
+    // Bit i is set while a guard holds record->pointers[i].
+    unsigned claimed;
+    std::vector<retired_node> retired;
+    std::vector<void*> hazards;
+
+public:
+    hazard_thread_state(hazard_thread_state const &) = delete;
+    hazard_thread_state &operator=(hazard_thread_state const &) = delete;
+
+    explicit hazard_thread_state(hazard_pointer_domain &domain_):
+        domain(domain_), record(domain_.acquire_record()), claimed(0) {
+    }
+
+    ~hazard_thread_state() {
+        domain.release_record(record);
+        domain.scan(retired, hazards);
+        domain.adopt(retired);
+    }
+
+    std::atomic<void*> &pointer(unsigned index) {
+        return record->pointers[index];
+    }
+
+    // Hands out a free slot of this thread's record, so guards can nest
+    // without clearing each other's hazards.
+    unsigned claim_pointer() {
+        for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+            if (!(claimed & (1u << i))) {
+                claimed |= 1u << i;
+                return i;
+            }
+        }
+        throw std::runtime_error("out of hazard pointers");
+    }
+
+    void release_pointer(unsigned index) {
+        record->pointers[index].store(nullptr, std::memory_order_release);
+        claimed &= ~(1u << index);
+    }
+
+    void retire(void *data, void (*deleter)(void*)) {
+        retired_node const node = {data, deleter};
+        retired.push_back(node);
+        if (retired.size() >= domain.scan_threshold()) {
+            domain.scan(retired, hazards);
+        }
+    }
+
+    void scan() {
+        domain.scan(retired, hazards);
+    }
+};
+
+inline hazard_thread_state &hazard_state_for_current_thread() {
+    thread_local static hazard_thread_state state(
+        default_hazard_pointer_domain());
+    return state;
+}
+
+inline std::atomic<void*> &get_hazard_pointer_for_current_thread(
+        unsigned index = 0) {
+    return hazard_state_for_current_thread().pointer(index);
+}
+
+inline bool outstanding_hazard_pointers_for(void *p) {
+    return default_hazard_pointer_domain().is_hazard(p);
+}
+
+template <typename T>
+void reclaim_later(T *data) {
+    hazard_state_for_current_thread().retire(data, &do_delete<T>);
+}
+
+// Forces a scan of this thread's retire list instead of waiting for it to
+// fill up.
+inline void delete_nodes_with_no_hazards() {
+    hazard_state_for_current_thread().scan();
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Recycles the memory of one node type. Each thread keeps a free list;
+// when it grows past two batches one batch moves to a shared depot, and a
+// thread that runs dry takes a whole batch back, so producer and consumer
+// threads stay balanced at one lock round trip per batch.
+//
+// Nodes must only come back through deallocate() once the reclaimer has
+// decided nobody can reach them; pass deallocate as the retire deleter.
+template <typename Node>
+class node_pool {
+private:
+    struct free_node {
+        free_node *next;
+    };
+
+    static std::size_t const node_size =
+        sizeof(Node) < sizeof(free_node) ? sizeof(free_node) : sizeof(Node);
+    static std::size_t const batch_size = 64;
+
+    typedef std::pair<free_node*, std::size_t> batch;
+
+    static void free_list(free_node *n) {
+        while (n) {
+            free_node *const next = n->next;
+            ::operator delete(n);
+            n = next;
+        }
+    }
+
+    struct depot {
+        std::mutex m;
+        std::vector<batch> batches;
+
+        ~depot() {
+            for (std::size_t i = 0; i < batches.size(); ++i) {
+                free_list(batches[i].first);
+            }
+        }
+
+        void put(batch b) {
+            std::lock_guard<std::mutex> lk(m);
+            batches.push_back(b);
+        }
+
+        batch take() {
+            std::lock_guard<std::mutex> lk(m);
+            if (batches.empty()) {
+                return batch(nullptr, 0);
+            }
+            batch const b = batches.back();
+            batches.pop_back();
+            return b;
+        }
+    };
+
+    struct cache {
+        free_node *head;
+        std::size_t count;
+
+        cache():
+            head(nullptr), count(0) {
+        }
+
+        ~cache() {
+            if (head) {
+                global_depot().put(batch(head, count));
+            }
+            cache_destroyed() = true;
+        }
+    };
+
+    static depot &global_depot() {
+        static depot d;
+        return d;
+    }
+
+    static cache &local_cache() {
+        thread_local static cache c;
+        return c;
+    }
+
+    // Reclaimers may still hand back nodes while other thread_locals are
+    // torn down after the cache. The flag lives outside the cache because
+    // stores a destructor makes to its own object are dead to the compiler.
+    static bool &cache_destroyed() {
+        thread_local static bool destroyed = false;
+        return destroyed;
+    }
+
+public:
+    static void *allocate() {
+        if (cache_destroyed()) {
+            return ::operator new(node_size);
+        }
+        cache &c = local_cache();
+        if (!c.head) {
+            batch const b = global_depot().take();
+            c.head = b.first;
+            c.count = b.second;
+        }
+        if (free_node *const n = c.head) {
+            c.head = n->next;
+            --c.count;
+            return n;
+        }
+        return ::operator new(node_size);
+    }
+
+    static void deallocate(void *p) {
+        if (cache_destroyed()) {
+            ::operator delete(p);
+            return;
+        }
+        cache &c = local_cache();
+        if (c.count >= 2 * batch_size) {
+            free_node *first = c.head;
+            free_node *last = first;
+            for (std::size_t i = 1; i < batch_size; ++i) {
+                last = last->next;
+            }
+            c.head = last->next;
+            c.count -= batch_size;
+            last->next = nullptr;
+            global_depot().put(batch(first, batch_size));
+        }
+        free_node *const n = static_cast<free_node*>(p);
+        n->next = c.head;
+        c.head = n;
+        ++c.count;
+    }
+};
+
+template <typename Node>
+std::size_t const node_pool<Node>::node_size;
+
+template <typename Node>
+std::size_t const node_pool<Node>::batch_size;
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef RECLAIMERS_H
+#define RECLAIMERS_H
+
+#include <atomic>
+#include <new>
+#include "epoch.h"
+#include "hazard_pointer.h"
+#include "node_pool.h"
+#include "retired_node.h"
+
+// Memory reclamation policies for the lock-free structures. Each provides
+//
+//   typename Reclaimer::guard g;      // held while touching shared nodes
+//   T *p = g.protect(src, slot);      // load src so that *p stays valid
+//   Reclaimer::retire(p);             // free p once no guard can reach it
+//   Reclaimer::retire(p, deleter);    // ... with deleter instead of delete
+//
+// protect() slots only matter for hazard pointers; the other policies
+// protect everything read while their guard is alive.
+
+// Tag for structures that keep the split reference counts of their
+// original implementation instead of using a reclaimer.
+struct split_reference_count {
+};
+
+// Frees retired nodes when the last thread leaves a guard. Cheapest when
+// guards rarely overlap; under sustained contention the count never drops
+// to zero and nothing is freed until it does. The list entries recording
+// retired nodes come from a node_pool, so retiring does not allocate.
+struct threads_in_pop_reclaimer {
+    struct pending_node {
+        retired_node node;
+        pending_node *next;
+    };
+
+    typedef node_pool<pending_node> pool;
+
+    struct state {
+        std::atomic<unsigned> threads_in_guard;
+        std::atomic<pending_node*> to_be_deleted;
+    };
+
+    static state &global_state() {
+        static state s = {{0}, {nullptr}};
+        return s;
+    }
+
+    static void delete_nodes(pending_node *nodes) {
+        while (nodes) {
+            pending_node *const next = nodes->next;
+            nodes->node.deleter(nodes->node.data);
+            pool::deallocate(nodes);
+            nodes = next;
+        }
+    }
+
+    static void chain_pending_nodes(pending_node *first, pending_node *last) {
+        state &s = global_state();
+        last->next = s.to_be_deleted.load();
+        while (!s.to_be_deleted.compare_exchange_weak(last->next, first)) ;
+    }
+
+    static void chain_pending_nodes(pending_node *nodes) {
+        pending_node *last = nodes;
+        while (pending_node *const next = last->next) {
+            last = next;
+        }
+        chain_pending_nodes(nodes, last);
+    }
+
+    class guard {
+    public:
+        guard(guard const &) = delete;
+        guard &operator=(guard const &) = delete;
+
+        guard() {
+            ++global_state().threads_in_guard;
+        }
+
+        ~guard() {
+            state &s = global_state();
+            if (s.threads_in_guard == 1) {
+                pending_node *const nodes = s.to_be_deleted.exchange(nullptr);
+                if (!--s.threads_in_guard) {
+                    delete_nodes(nodes);
+                } else if (nodes) {
+                    chain_pending_nodes(nodes);
+                }
+            } else {
+                --s.threads_in_guard;
+            }
+        }
+
+        template <typename T>
+        T *protect(std::atomic<T*> const &src, unsigned = 0) {
+            return src.load();
+        }
+    };
+
+    template <typename T>
+    static void retire(T *p, void (*deleter)(void*) = &do_delete<T>) {
+        pending_node *const n = new (pool::allocate()) pending_node;
+        n->node.data = p;
+        n->node.deleter = deleter;
+        n->next = nullptr;
+        chain_pending_nodes(n, n);
+    }
+};
+
+struct hazard_pointer_reclaimer {
+    // Guards nest: each maps its protect() slots onto record slots that no
+    // other live guard on the thread holds.
+    class guard {
+    private:
+        static unsigned char const no_slot = 0xff;
+
+        hazard_thread_state &state;
+        unsigned char slots[hazard_pointers_per_thread];
+
+    public:
+        guard(guard const &) = delete;
+        guard &operator=(guard const &) = delete;
+
+        guard():
+            state(hazard_state_for_current_thread()) {
+            for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+                slots[i] = no_slot;
+            }
+        }
+
+        ~guard() {
+            for (unsigned i = 0; i < hazard_pointers_per_thread; ++i) {
+                if (slots[i] != no_slot) {
+                    state.release_pointer(slots[i]);
+                }
+            }
+        }
+
+        template <typename T>
+        T *protect(std::atomic<T*> const &src, unsigned slot = 0) {
+            if (slots[slot] == no_slot) {
+                slots[slot] = static_cast<unsigned char>(
+                    state.claim_pointer());
+            }
+            std::atomic<void*> &hp = state.pointer(slots[slot]);
+            T *p = src.load();
+            for (;;) {
+                hp.store(p);
+                T *const again = src.load();
+                if (again == p) {
+                    return p;
+                }
+                p = again;
+            }
+        }
+    };
+
+    template <typename T>
+    static void retire(T *p, void (*deleter)(void*) = &do_delete<T>) {
+        hazard_state_for_current_thread().retire(p, deleter);
+    }
+};
+
+struct epoch_reclaimer {
+    class guard {
+    private:
+        epoch_guard region;
+
+    public:
+        template <typename T>
+        T *protect(std::atomic<T*> const &src, unsigned = 0) {
+            return src.load(std::memory_order_acquire);
+        }
+    };
+
+    template <typename T>
+    static void retire(T *p, void (*deleter)(void*) = &do_delete<T>) {
+        epoch_state_for_current_thread().retire(p, deleter);
+    }
+};
+
+#endif
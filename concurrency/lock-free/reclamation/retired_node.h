@@ -0,0 +1,16 @@
+#ifndef RETIRED_NODE_H
+#define RETIRED_NODE_H
+
+// A node unlinked from a structure but not yet freed, with the function
+// that frees it.
+struct retired_node {
+    void *data;
+    void (*deleter)(void*);
+};
+
+template <typename T>
+void do_delete(void *p) {
+    delete static_cast<T*>(p);
+}
+
+#endif
@@ -0,0 +1,184 @@
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "../../thread-pool/event_count.h"
+
+// Bounded single-producer single-consumer ring. Each side owns one index
+// and keeps a private copy of the other's, rereading the shared one only
+// when the copy says the ring is full (producer) or empty (consumer), so
+// in steady state a push or pop touches no cache line the other side
+// writes except the slot itself. Both operations are wait-free.
+template <typename T>
+class spsc_queue {
+private:
+    static std::size_t const cache_line = 64;
+
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type slot;
+
+    char pad0[cache_line];
+    // Written by the producer.
+    std::atomic<std::size_t> tail;
+    std::size_t cached_head;
+    char pad1[cache_line - sizeof(std::atomic<std::size_t>) -
+              sizeof(std::size_t)];
+    // Written by the consumer.
+    std::atomic<std::size_t> head;
+    std::size_t cached_tail;
+    char pad2[cache_line - sizeof(std::atomic<std::size_t>) -
+              sizeof(std::size_t)];
+
+    std::size_t const mask;
+    std::unique_ptr<slot[]> slots;
+
+    static std::size_t round_up_to_power_of_two(std::size_t n) {
+        std::size_t res = 1;
+        while (res < n) {
+            res <<= 1;
+        }
+        return res;
+    }
+
+    T &data(std::size_t pos) {
+        return *reinterpret_cast<T*>(&slots[pos & mask]);
+    }
+
+public:
+    // capacity is rounded up to a power of two.
+    explicit spsc_queue(std::size_t capacity):
+        tail(0), cached_head(0), head(0), cached_tail(0),
+        mask(round_up_to_power_of_two(capacity < 2 ? 2 : capacity) - 1),
+        slots(new slot[mask + 1]) {
+    }
+
+    spsc_queue(spsc_queue const &) = delete;
+    spsc_queue &operator=(spsc_queue const &) = delete;
+
+    ~spsc_queue() {
+        std::size_t const last = tail.load();
+        for (std::size_t pos = head.load(); pos != last; ++pos) {
+            data(pos).~T();
+        }
+    }
+
+    std::size_t capacity() const {
+        return mask + 1;
+    }
+
+    // Producer only. value is left untouched if the ring is full.
+    template <typename U>
+    bool try_push(U &&value) {
+        std::size_t const pos = tail.load(std::memory_order_relaxed);
+        if (pos - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (pos - cached_head > mask) {
+                return false;
+            }
+        }
+        new (&slots[pos & mask]) T(std::forward<U>(value));
+        tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool try_pop(T &value) {
+        std::size_t const pos = head.load(std::memory_order_relaxed);
+        if (pos == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (pos == cached_tail) {
+                return false;
+            }
+        }
+        value = std::move(data(pos));
+        data(pos).~T();
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Exact from either side; a snapshot otherwise.
+    bool empty() const {
+        return head.load(std::memory_order_acquire) ==
+            tail.load(std::memory_order_acquire);
+    }
+};
+
+// spsc_queue whose producer sleeps while the ring is full and whose
+// consumer sleeps while it is empty, after yielding a few times first in
+// case the other side is only briefly behind. Neither side pays for the
+// other beyond a fenced load unless someone is actually asleep.
+template <typename T>
+class blocking_spsc_queue {
+private:
+    static unsigned const spin_count = 64;
+
+    spsc_queue<T> q;
+    event_count not_empty;
+    event_count not_full;
+
+public:
+    explicit blocking_spsc_queue(std::size_t capacity):
+        q(capacity) {
+    }
+
+    std::size_t capacity() const {
+        return q.capacity();
+    }
+
+    template <typename U>
+    bool try_push(U &&value) {
+        if (!q.try_push(std::forward<U>(value))) {
+            return false;
+        }
+        not_empty.notify();
+        return true;
+    }
+
+    template <typename U>
+    void push(U &&value) {
+        for (unsigned spins = 0; !q.try_push(std::forward<U>(value));
+             ++spins) {
+            if (spins < spin_count) {
+                std::this_thread::yield();
+                continue;
+            }
+            event_count::key const k = not_full.prepare_wait();
+            if (q.try_push(std::forward<U>(value))) {
+                not_full.cancel_wait();
+                break;
+            }
+            not_full.commit_wait(k);
+        }
+        not_empty.notify();
+    }
+
+    bool try_pop(T &value) {
+        if (!q.try_pop(value)) {
+            return false;
+        }
+        not_full.notify();
+        return true;
+    }
+
+    void wait_and_pop(T &value) {
+        for (unsigned spins = 0; !q.try_pop(value); ++spins) {
+            if (spins < spin_count) {
+                std::this_thread::yield();
+                continue;
+            }
+            event_count::key const k = not_empty.prepare_wait();
+            if (q.try_pop(value)) {
+                not_empty.cancel_wait();
+                break;
+            }
+            not_empty.commit_wait(k);
+        }
+        not_full.notify();
+    }
+
+    bool empty() const {
+        return q.empty();
+    }
+};
@@ -0,0 +1,19 @@
+#include <map>
+#include <string>
+#include "rcu.h"
+
+class dns_entry;
+
+// The shared_mutex dns_cache with the map behind RCU: lookups never
+// write to shared memory, so they scale with the number of readers.
+class dns_cache {
+  rcu_map<std::string, dns_entry> entries;
+public:
+  dns_entry find_entry(std::string const &domain) const {
+    return entries.value_for(domain, dns_entry());
+  }
+  void update_or_add_entry(std::string const &domain, 
+                          dns_entry const& dns_details) {
+    entries.add_or_update_mapping(domain, dns_details);
+  }
+};
@@ -0,0 +1,155 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include "../lock-free/reclamation/reclaimers.h"
+
+// Read-copy-update. Readers load the current version under a reclaimer
+// guard, which touches only their own thread's state, so reads are
+// wait-free and share no cache line with each other. Writers are
+// serialized; each copies the current version, changes the copy, publishes
+// it with one exchange and retires the old version through the reclaimer,
+// which frees it once no reader can still hold it. Suited to data that is
+// read far more often than written: every write copies the whole value.
+template <typename T, typename Reclaimer = epoch_reclaimer>
+class rcu_cell {
+private:
+    std::atomic<T*> current;
+    std::mutex writer_mutex;
+
+    void publish(T *fresh) {
+        T *const old = current.exchange(fresh, std::memory_order_acq_rel);
+        Reclaimer::retire(old);
+    }
+
+public:
+    // Keeps the version current at construction alive, however many
+    // updates follow, until it is destroyed on the same thread. Snapshots
+    // nest with any reclaimer; with hazard_pointer_reclaimer each one holds
+    // a hazard pointer, so a thread can keep hazard_pointers_per_thread of
+    // them at once, and taking one more throws.
+    class snapshot {
+    private:
+        typename Reclaimer::guard guard;
+        T const *value;
+
+    public:
+        snapshot(snapshot const &) = delete;
+        snapshot &operator=(snapshot const &) = delete;
+
+        explicit snapshot(rcu_cell const &cell):
+            value(guard.protect(cell.current)) {
+        }
+
+        T const &operator*() const {
+            return *value;
+        }
+
+        T const *operator->() const {
+            return value;
+        }
+    };
+
+    explicit rcu_cell(T const &initial = T()):
+        current(new T(initial)) {
+    }
+
+    rcu_cell(rcu_cell const &) = delete;
+    rcu_cell &operator=(rcu_cell const &) = delete;
+
+    ~rcu_cell() {
+        delete current.load();
+    }
+
+    // Calls f on the current version and returns what it returns.
+    template <typename F>
+    auto read(F f) const -> decltype(f(std::declval<T const &>())) {
+        snapshot s(*this);
+        return f(*s);
+    }
+
+    T load() const {
+        snapshot s(*this);
+        return *s;
+    }
+
+    void store(T const &value) {
+        T *const fresh = new T(value);
+        std::lock_guard<std::mutex> lk(writer_mutex);
+        publish(fresh);
+    }
+
+    // Applies f to a private copy of the current version, then publishes
+    // the copy.
+    template <typename F>
+    void update(F f) {
+        std::lock_guard<std::mutex> lk(writer_mutex);
+        T *const fresh = new T(*current.load(std::memory_order_relaxed));
+        try {
+            f(*fresh);
+        } catch (...) {
+            delete fresh;
+            throw;
+        }
+        publish(fresh);
+    }
+};
+
+// A std::map behind an rcu_cell, for read-mostly tables.
+template <typename Key, typename Value, typename Compare = std::less<Key>,
+          typename Reclaimer = epoch_reclaimer>
+class rcu_map {
+public:
+    typedef std::map<Key, Value, Compare> map_type;
+
+private:
+    rcu_cell<map_type, Reclaimer> cell;
+
+public:
+    // Pins the whole map as of construction, for iterating it without a
+    // copy.
+    class snapshot : public rcu_cell<map_type, Reclaimer>::snapshot {
+    public:
+        explicit snapshot(rcu_map const &m):
+            rcu_cell<map_type, Reclaimer>::snapshot(m.cell) {
+        }
+    };
+
+    bool find(Key const &key, Value &value) const {
+        snapshot s(*this);
+        typename map_type::const_iterator const it = s->find(key);
+        if (it == s->end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    Value value_for(Key const &key, Value const &default_value = Value()) const {
+        snapshot s(*this);
+        typename map_type::const_iterator const it = s->find(key);
+        return (it == s->end())?default_value:it->second;
+    }
+
+    void add_or_update_mapping(Key const &key, Value const &value) {
+        cell.update([&](map_type &m) {
+            m[key] = value;
+        });
+    }
+
+    void remove_mapping(Key const &key) {
+        cell.update([&](map_type &m) {
+            m.erase(key);
+        });
+    }
+
+    map_type get_map() const {
+        return cell.load();
+    }
+};
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// C++20 coroutines on top of thread_pool. Everything here is written
+// against the pool's post() and the task_future its submit() returns, so
+// it works with any pool offering those.
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "fused_task.h"
+
+template <typename T = void>
+class task;
+
+class task_promise_base {
+    // Symmetric transfer: a finishing task resumes whoever awaited it on
+    // the same thread and without growing the stack.
+    struct final_awaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<Promise> h) const noexcept {
+            return h.promise().continuation;
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+public:
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() const noexcept {
+        return {};
+    }
+
+    final_awaiter final_suspend() const noexcept {
+        return {};
+    }
+
+    void unhandled_exception() noexcept {
+        error = std::current_exception();
+    }
+
+    void rethrow_if_failed() const {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+template <typename T>
+class task_promise: public task_promise_base {
+    std::optional<T> value;
+
+public:
+    task<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U &&v) {
+        value.emplace(std::forward<U>(v));
+    }
+
+    T result() {
+        rethrow_if_failed();
+        return std::move(*value);
+    }
+};
+
+template <>
+class task_promise<void>: public task_promise_base {
+public:
+    task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {
+    }
+
+    void result() const {
+        rethrow_if_failed();
+    }
+};
+
+// Lazily started coroutine. It runs when first awaited, on the awaiting
+// thread, and hands its result back to exactly one awaiter.
+template <typename T>
+class task {
+public:
+    typedef task_promise<T> promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    struct awaiter {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept {
+            return handle.done();
+        }
+
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+
+        T await_resume() const {
+            return handle.promise().result();
+        }
+    };
+
+public:
+    explicit task(std::coroutine_handle<promise_type> h) noexcept:
+        handle(h) {
+    }
+
+    task(task &&other) noexcept:
+        handle(std::exchange(other.handle, nullptr)) {
+    }
+
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    task(task const &) = delete;
+    task &operator=(task const &) = delete;
+
+    ~task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    awaiter operator co_await() const noexcept {
+        return awaiter{handle};
+    }
+};
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+    return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+}
+
+// co_await schedule(pool) moves the coroutine onto one of pool's workers.
+// From a worker the continuation goes on that worker's own deque, so it
+// stays where its data is hot unless someone steals it. If the pool drops
+// it on shutdown the coroutine is resumed with task_cancelled.
+template <typename Pool>
+class schedule_awaiter {
+    Pool &pool;
+    bool cancelled;
+
+    struct resume_task {
+        schedule_awaiter *awaiter;
+        std::coroutine_handle<> handle;
+
+        void operator()() {
+            handle.resume();
+        }
+
+        void cancel() {
+            awaiter->cancelled = true;
+            handle.resume();
+        }
+    };
+
+public:
+    explicit schedule_awaiter(Pool &pool_):
+        pool(pool_), cancelled(false) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        pool.post(resume_task{this, h});
+    }
+
+    void await_resume() const {
+        if (cancelled) {
+            throw task_cancelled();
+        }
+    }
+};
+
+template <typename Pool>
+schedule_awaiter<Pool> schedule(Pool &pool) {
+    return schedule_awaiter<Pool>(pool);
+}
+
+// Awaits a future returned by pool.submit() without tying up a worker:
+// the coroutine registers itself on the task and is resumed by whichever
+// thread completes it, cancels it or drops it on shutdown.
+template <typename T>
+class future_awaiter {
+    task_future<T> future;
+
+    static void resume(void *address) {
+        std::coroutine_handle<>::from_address(address).resume();
+    }
+
+public:
+    explicit future_awaiter(task_future<T> &&future_):
+        future(std::move(future_)) {
+    }
+
+    bool await_ready() const {
+        return future.shared_state()->is_complete();
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        return future.shared_state()->set_waiter(&resume, h.address());
+    }
+
+    T await_resume() {
+        return future.get();
+    }
+};
+
+template <typename T>
+future_awaiter<T> await_future(task_future<T> future) {
+    return future_awaiter<T>(std::move(future));
+}
+
+// Runs f on the pool and resumes the awaiting coroutine on the worker that
+// ran it.
+template <typename Pool, typename F>
+task<typename std::invoke_result<F>::type> run_on(Pool &pool, F f) {
+    co_await schedule(pool);
+    co_return f();
+}
+
+// Coroutine frame that starts eagerly and frees itself when it finishes;
+// only used to bridge a task to a std::future.
+struct detached_coroutine {
+    struct promise_type {
+        detached_coroutine get_return_object() const noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_void() const noexcept {
+        }
+
+        void unhandled_exception() const noexcept {
+            std::terminate();
+        }
+    };
+};
+
+template <typename Pool, typename T>
+detached_coroutine run_detached(Pool &pool, task<T> t, std::promise<T> p) {
+    try {
+        co_await schedule(pool);
+        if constexpr (std::is_void<T>::value) {
+            co_await t;
+            p.set_value();
+        } else {
+            p.set_value(co_await t);
+        }
+    } catch (...) {
+        p.set_exception(std::current_exception());
+    }
+}
+
+// Starts t on the pool. Wait for the result with pool.wait()/pool.get(),
+// which keep a worker busy with other tasks meanwhile.
+template <typename Pool, typename T>
+std::future<T> spawn(Pool &pool, task<T> t) {
+    std::promise<T> p;
+    std::future<T> res = p.get_future();
+    run_detached(pool, std::move(t), std::move(p));
+    return res;
+}
+
+#endif
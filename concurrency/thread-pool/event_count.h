@@ -0,0 +1,101 @@
+#ifndef EVENT_COUNT_H
+#define EVENT_COUNT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Lets a thread sleep until some condition it polls for may have changed.
+// A waiter calls prepare_wait(), re-checks its condition, then either
+// cancel_wait() or commit_wait(key). notify() is a single fenced load when
+// nobody is waiting, so producers can call it on every push.
+class event_count {
+    static std::uint64_t const waiter_mask = 0xffffffffu;
+    static unsigned const epoch_shift = 32;
+
+    std::atomic<std::uint64_t> state;
+    std::mutex m;
+    std::condition_variable cond;
+
+    void do_notify(bool all) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t const prev = state.load(std::memory_order_relaxed);
+        if (!(prev & waiter_mask)) {
+            return;
+        }
+        state.fetch_add(std::uint64_t(1) << epoch_shift,
+                        std::memory_order_acq_rel);
+        {
+            std::lock_guard<std::mutex> lk(m);
+        }
+        if (all) {
+            cond.notify_all();
+        } else {
+            cond.notify_one();
+        }
+    }
+
+public:
+    typedef std::uint32_t key;
+
+    event_count():
+        state(0) {
+    }
+
+    event_count(event_count const &) = delete;
+    event_count &operator=(event_count const &) = delete;
+
+    key prepare_wait() {
+        std::uint64_t const prev =
+            state.fetch_add(1, std::memory_order_acq_rel);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return key(prev >> epoch_shift);
+    }
+
+    void cancel_wait() {
+        state.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void commit_wait(key k) {
+        {
+            std::unique_lock<std::mutex> lk(m);
+            cond.wait(lk, [&] {
+                return key(state.load(std::memory_order_acquire) >>
+                           epoch_shift) != k;
+            });
+        }
+        state.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Returns false if the timeout expired without a notify.
+    template <typename Rep, typename Period>
+    bool commit_wait_for(key k,
+                         std::chrono::duration<Rep, Period> const &timeout) {
+        bool notified;
+        {
+            std::unique_lock<std::mutex> lk(m);
+            notified = cond.wait_for(lk, timeout, [&] {
+                return key(state.load(std::memory_order_acquire) >>
+                           epoch_shift) != k;
+            });
+        }
+        state.fetch_sub(1, std::memory_order_relaxed);
+        return notified;
+    }
+
+    unsigned waiters() const {
+        return unsigned(state.load(std::memory_order_relaxed) & waiter_mask);
+    }
+
+    void notify() {
+        do_notify(false);
+    }
+
+    void notify_all() {
+        do_notify(true);
+    }
+};
+
+#endif
@@ -1,41 +1,207 @@
+#ifndef FUNCTION_WRAPPER_H
+#define FUNCTION_WRAPPER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A callable may be relocated with memcpy (and its source then forgotten)
+// if it is trivially copyable; handle types that only own a pointer can
+// opt in by specializing this.
+template <typename F>
+struct is_trivially_relocatable : std::is_trivially_copyable<F> {
+};
+
+// Callables with a cancel() member get it called when a queued task is
+// dropped instead of run, so they can release whoever is waiting on them.
+template <typename F>
+class has_cancel {
+    template <typename U>
+    static char test(decltype(std::declval<U &>().cancel()) *);
+    template <typename U>
+    static long test(...);
+
+public:
+    static bool const value = sizeof(test<F>(0)) == 1;
+};
+
+// Move-only type-erased nullary callable. Trivially relocatable callables of
+// up to inline_size bytes are stored in place; anything else lives on the
+// heap behind a pointer kept in the same storage. Either way a
+// function_wrapper is itself trivially relocatable, which is what lets
+// work_stealing_queue copy it in and out of its slots word by word.
 class function_wrapper {
-    struct impl_base {
-        virtual void call() = 0;
-        virtual ~impl_base() {
-        };
+    friend class work_stealing_queue;
+
+public:
+    static std::size_t const inline_size = 56;
+
+private:
+    struct ops_type {
+        void (*call)(void *);
+        void (*destroy)(void *);
+        void (*cancel)(void *);
     };
-    std::unique_ptr<impl_base> impl;
+
     template <typename F>
-    struct impl_type : impl_base {
-        F f;
-        impl_type(F&& f_): f(std::move(f_)) {
+    static void cancel_callable(F &f, std::true_type) {
+        f.cancel();
+    }
+
+    template <typename F>
+    static void cancel_callable(F &, std::false_type) {
+    }
+
+    template <typename F>
+    struct inline_ops {
+        static void call(void *p) {
+            (*static_cast<F *>(p))();
         }
-        void call() {
-            f();
+        static void cancel(void *p) {
+            cancel_callable(*static_cast<F *>(p),
+                std::integral_constant<bool, has_cancel<F>::value>());
         }
+        static void destroy(void *p) {
+            static_cast<F *>(p)->~F();
+        }
+        static ops_type const table;
     };
+
+    template <typename F>
+    struct heap_ops {
+        static void call(void *p) {
+            (**static_cast<F **>(p))();
+        }
+        static void cancel(void *p) {
+            cancel_callable(**static_cast<F **>(p),
+                std::integral_constant<bool, has_cancel<F>::value>());
+        }
+        static void destroy(void *p) {
+            delete *static_cast<F **>(p);
+        }
+        static ops_type const table;
+    };
+
+    typedef std::aligned_storage<inline_size, alignof(void *)>::type
+        storage_type;
+
+    ops_type const *ops;
+    storage_type storage;
+
+    template <typename F>
+    struct stored_inline {
+        static bool const value = sizeof(F) <= sizeof(storage_type) &&
+            alignof(F) <= alignof(storage_type) &&
+            is_trivially_relocatable<F>::value;
+    };
+
+    template <typename F, typename Arg>
+    void emplace(Arg &&arg, std::true_type) {
+        new (&storage) F(std::forward<Arg>(arg));
+        ops = &inline_ops<F>::table;
+    }
+
+    template <typename F, typename Arg>
+    void emplace(Arg &&arg, std::false_type) {
+        *reinterpret_cast<F **>(&storage) = new F(std::forward<Arg>(arg));
+        ops = &heap_ops<F>::table;
+    }
+
+    void reset() {
+        if (ops) {
+            if (ops->destroy) {
+                ops->destroy(&storage);
+            }
+            ops = nullptr;
+        }
+    }
+
+    static std::size_t const raw_words =
+        (sizeof(ops_type const *) + sizeof(storage_type)) /
+        sizeof(std::uintptr_t);
+
+    void to_raw(std::uintptr_t *raw) {
+        std::memcpy(raw, &ops, sizeof(ops));
+        std::memcpy(raw + 1, &storage, sizeof(storage));
+        ops = nullptr;
+    }
+
+    void from_raw(std::uintptr_t const *raw) {
+        reset();
+        std::memcpy(&ops, raw, sizeof(ops));
+        std::memcpy(&storage, raw + 1, sizeof(storage));
+    }
+
 public:
     template <typename F>
-    function_wrapper(F&& f):
-        impl(new impl_type<F>(std::move(f))) {
+    function_wrapper(F &&f):
+        ops(nullptr) {
+        typedef typename std::decay<F>::type functor_type;
+        emplace<functor_type>(std::forward<F>(f),
+            std::integral_constant<bool,
+                stored_inline<functor_type>::value>());
     }
 
     void operator()() {
-        impl->call();
+        ops->call(&storage);
+    }
+
+    explicit operator bool() const {
+        return ops != nullptr;
     }
 
-    function_wrapper() = default;
+    // Drops the callable without running it.
+    void cancel() {
+        if (ops) {
+            ops->cancel(&storage);
+            reset();
+        }
+    }
+
+    function_wrapper():
+        ops(nullptr) {
+    }
 
-    function_wrapper(function_wrapper&& other):
-        impl(std::move(other.impl)) {
+    ~function_wrapper() {
+        reset();
     }
 
-    function_wrapper& operator=(function_wrapper&& other) {
-        impl = std::move(other.impl);
+    function_wrapper(function_wrapper &&other):
+        ops(other.ops), storage(other.storage) {
+        other.ops = nullptr;
+    }
+
+    function_wrapper &operator=(function_wrapper &&other) {
+        if (this != &other) {
+            reset();
+            ops = other.ops;
+            storage = other.storage;
+            other.ops = nullptr;
+        }
         return *this;
     }
 
-    function_wrapper(const function_wrapper&) = delete;
-    function_wrapper(function_wrapper&) = delete;
-    function_wrapper& operator=(const function_wrapper&) = delete;
-};
\ No newline at end of file
+    function_wrapper(const function_wrapper &) = delete;
+    function_wrapper(function_wrapper &) = delete;
+    function_wrapper &operator=(const function_wrapper &) = delete;
+};
+
+template <typename F>
+function_wrapper::ops_type const function_wrapper::inline_ops<F>::table = {
+    &function_wrapper::inline_ops<F>::call,
+    std::is_trivially_destructible<F>::value ?
+        nullptr : &function_wrapper::inline_ops<F>::destroy,
+    &function_wrapper::inline_ops<F>::cancel
+};
+
+template <typename F>
+function_wrapper::ops_type const function_wrapper::heap_ops<F>::table = {
+    &function_wrapper::heap_ops<F>::call,
+    &function_wrapper::heap_ops<F>::destroy,
+    &function_wrapper::heap_ops<F>::cancel
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef FUSED_TASK_H
+#define FUSED_TASK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "function_wrapper.h"
+
+struct task_cancelled: std::exception {
+    const char* what() const throw() {
+        return "task cancelled";
+    }
+};
+
+// The part of a fused_task's block that does not depend on the callable:
+// the reference count and a single waiter to call once the task's result
+// (value, exception, cancellation or broken promise) is in place.
+class fused_state {
+    std::atomic<unsigned> refs;
+    std::atomic<void *> waiter;
+    void (*wake)(void *);
+    void (*free_block)(fused_state *);
+
+    void *completed() {
+        return this;
+    }
+
+    void const *completed() const {
+        return this;
+    }
+
+protected:
+    explicit fused_state(void (*free_block_)(fused_state *)):
+        refs(1), waiter(nullptr), wake(nullptr), free_block(free_block_) {
+    }
+
+public:
+    void add_ref() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            free_block(this);
+        }
+    }
+
+    bool is_complete() const {
+        return waiter.load(std::memory_order_acquire) == completed();
+    }
+
+    // Arranges for wake_(context) to run on the thread that completes the
+    // task. Returns false, without registering anything, if it already has.
+    // At most one waiter per task.
+    bool set_waiter(void (*wake_)(void *), void *context) {
+        wake = wake_;
+        void *expected = nullptr;
+        return waiter.compare_exchange_strong(expected, context,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire);
+    }
+
+    // Called once the result is set; later calls do nothing.
+    void complete() {
+        void *const w = waiter.exchange(completed(), std::memory_order_acq_rel);
+        if (w && w != completed()) {
+            wake(w);
+        }
+    }
+};
+
+// std::future for a fused_task, keeping a reference to its block so a waiter
+// can be registered on it. Converts to a plain std::future by moving.
+template <typename R>
+class task_future: public std::future<R> {
+    fused_state *state;
+
+public:
+    task_future(std::future<R> &&f, fused_state *state_):
+        std::future<R>(std::move(f)), state(state_) {
+        state->add_ref();
+    }
+
+    task_future(task_future &&other):
+        std::future<R>(std::move(other)), state(other.state) {
+        other.state = nullptr;
+    }
+
+    task_future &operator=(task_future &&other) {
+        if (this != &other) {
+            if (state) {
+                state->release();
+            }
+            std::future<R>::operator=(std::move(other));
+            state = other.state;
+            other.state = nullptr;
+        }
+        return *this;
+    }
+
+    ~task_future() {
+        if (state) {
+            state->release();
+        }
+    }
+
+    fused_state *shared_state() const {
+        return state;
+    }
+};
+
+// Does the job of std::packaged_task<R()>, but the callable, the promise and
+// the promise's shared state are carved out of a single allocation. The
+// shared state is placed in an arena at the end of the block through the
+// promise's allocator; the block is freed once both the task and the shared
+// state are gone. A fused_task is just a pointer to its block, so it fits in
+// a function_wrapper without a second allocation.
+template <typename R, typename F>
+class fused_task {
+    typedef typename std::conditional<std::is_void<R>::value, char, R>::type
+        value_type;
+
+    static std::size_t const arena_size = 160 + sizeof(value_type);
+
+    struct block: fused_state {
+        std::size_t arena_used;
+        typename std::aligned_storage<sizeof(F), alignof(F)>::type f;
+        typename std::aligned_storage<sizeof(std::promise<R>),
+                                      alignof(std::promise<R>)>::type promise;
+        typename std::aligned_storage<arena_size,
+                                      alignof(std::max_align_t)>::type arena;
+
+        block():
+            fused_state(&free_block), arena_used(0) {
+        }
+
+        static void free_block(fused_state *s) {
+            block *const b = static_cast<block *>(s);
+            b->~block();
+            ::operator delete(b);
+        }
+
+        F &func() {
+            return *reinterpret_cast<F *>(&f);
+        }
+
+        std::promise<R> &prom() {
+            return *reinterpret_cast<std::promise<R> *>(&promise);
+        }
+
+        bool in_arena(void const *p) const {
+            std::uintptr_t const addr = reinterpret_cast<std::uintptr_t>(p);
+            std::uintptr_t const first =
+                reinterpret_cast<std::uintptr_t>(&arena);
+            return addr >= first && addr < first + arena_size;
+        }
+    };
+
+    template <typename T>
+    struct arena_allocator {
+        typedef T value_type;
+
+        block *b;
+
+        explicit arena_allocator(block *b_):
+            b(b_) {
+        }
+
+        template <typename U>
+        arena_allocator(arena_allocator<U> const &other):
+            b(other.b) {
+        }
+
+        T *allocate(std::size_t n) {
+            std::size_t const bytes = n * sizeof(T);
+            std::size_t const offset =
+                (b->arena_used + alignof(T) - 1) & ~(alignof(T) - 1);
+            if (alignof(T) <= alignof(std::max_align_t) &&
+                offset + bytes <= arena_size) {
+                b->arena_used = offset + bytes;
+                b->add_ref();
+                return reinterpret_cast<T *>(
+                    reinterpret_cast<char *>(&b->arena) + offset);
+            }
+            return static_cast<T *>(::operator new(bytes));
+        }
+
+        void deallocate(T *p, std::size_t) {
+            if (b->in_arena(p)) {
+                b->release();
+            } else {
+                ::operator delete(p);
+            }
+        }
+
+        template <typename U>
+        bool operator==(arena_allocator<U> const &other) const {
+            return b == other.b;
+        }
+
+        template <typename U>
+        bool operator!=(arena_allocator<U> const &other) const {
+            return b != other.b;
+        }
+    };
+
+    block *b;
+
+    void run(std::false_type) {
+        b->prom().set_value(b->func()());
+    }
+
+    void run(std::true_type) {
+        b->func()();
+        b->prom().set_value();
+    }
+
+public:
+    explicit fused_task(F f):
+        b(new (::operator new(sizeof(block))) block) {
+        new (&b->f) F(std::move(f));
+        new (&b->promise) std::promise<R>(std::allocator_arg,
+                                          arena_allocator<value_type>(b));
+    }
+
+    fused_task(fused_task &&other):
+        b(other.b) {
+        other.b = nullptr;
+    }
+
+    fused_task(fused_task const &) = delete;
+    fused_task &operator=(fused_task const &) = delete;
+
+    // A task destroyed without having run leaves its future with a
+    // broken_promise error, as std::packaged_task does.
+    ~fused_task() {
+        if (b) {
+            b->func().~F();
+            b->prom().~promise();
+            b->complete();
+            b->release();
+        }
+    }
+
+    task_future<R> get_future() {
+        return task_future<R>(b->prom().get_future(), b);
+    }
+
+    void operator()() {
+        try {
+            run(std::is_void<R>());
+        } catch (...) {
+            b->prom().set_exception(std::current_exception());
+        }
+        b->complete();
+    }
+
+    void cancel() {
+        b->prom().set_exception(std::make_exception_ptr(task_cancelled()));
+        b->complete();
+    }
+};
+
+template <typename R, typename F>
+struct is_trivially_relocatable<fused_task<R, F>> : std::true_type {
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Bucket 0 counts zeros; bucket i counts values in [2^(i-1), 2^i).
+struct histogram_snapshot {
+    std::vector<std::uint64_t> buckets;
+
+    std::uint64_t count() const {
+        std::uint64_t res = 0;
+        for (unsigned i = 0; i < buckets.size(); ++i) {
+            res += buckets[i];
+        }
+        return res;
+    }
+
+    static std::uint64_t bucket_upper_bound(unsigned i) {
+        return i >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << i) - 1;
+    }
+
+    // Upper bound of the bucket holding the given percentile (0-100).
+    std::uint64_t percentile(double p) const {
+        std::uint64_t const total = count();
+        if (!total) {
+            return 0;
+        }
+        std::uint64_t rank = std::uint64_t(p / 100.0 * double(total));
+        if (rank >= total) {
+            rank = total - 1;
+        }
+        std::uint64_t seen = 0;
+        for (unsigned i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return bucket_upper_bound(i);
+            }
+        }
+        return bucket_upper_bound(buckets.size() - 1);
+    }
+};
+
+// Power-of-two histogram that many threads can record into concurrently.
+class log2_histogram {
+public:
+    static unsigned const bucket_count = 65;
+
+private:
+    std::atomic<std::uint64_t> buckets[bucket_count];
+
+    static unsigned bucket_for(std::uint64_t value) {
+        return value ? 64 - __builtin_clzll(value) : 0;
+    }
+
+public:
+    log2_histogram() {
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    log2_histogram(log2_histogram const &) = delete;
+    log2_histogram &operator=(log2_histogram const &) = delete;
+
+    void record(std::uint64_t value) {
+        buckets[bucket_for(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    histogram_snapshot snapshot() const {
+        histogram_snapshot res;
+        res.buckets.resize(bucket_count);
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            res.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        }
+        return res;
+    }
+};
+
+#endif
@@ -1,87 +1,1013 @@
 #include "function_wrapper.h"
+#include "fused_task.h"
 #include "work_stealing_queue.h"
 #include "join_threads.h"
+#include "event_count.h"
+#include "topology.h"
+#include "histogram.h"
+#include "pool_stats.h"
+#include "trace_buffer.h"
+
+enum class shutdown_mode {
+    // Run everything already queued, then stop.
+    drain,
+    // Stop after the running tasks; queued tasks are dropped and their
+    // futures fail with task_cancelled.
+    cancel
+};
+
+struct thread_pool_options {
+    // Workers started up front. 0 means std::thread::hardware_concurrency().
+    unsigned thread_count;
+    // The pool grows towards max_threads while work backs up with no idle
+    // worker, and a worker above min_threads exits after idle_timeout
+    // without work. Both default (0) to thread_count, i.e. a fixed size.
+    unsigned min_threads;
+    unsigned max_threads;
+    std::chrono::milliseconds idle_timeout;
+    // Pin worker i to the i-th online CPU, and steal from the nearest
+    // workers first.
+    bool pin_threads;
+    // Number of priority lanes for submit(priority, f); 0 is the most
+    // urgent. Plain submit(f) work ranks at priority_levels / 2, and
+    // submitting at that priority is the same as plain submit(f).
+    unsigned priority_levels;
+    // Every this many tasks a worker serves one priority level out of
+    // turn, taking the levels round-robin, so none of them can starve.
+    unsigned starvation_interval;
+    // Per-worker counters and task timings for stats().
+    bool collect_stats;
+    // Task begin/end events kept per worker for dump_trace(); 0 disables
+    // tracing.
+    std::size_t trace_capacity;
+
+    thread_pool_options():
+        thread_count(0), min_threads(0), max_threads(0), idle_timeout(1000),
+        pin_threads(false), priority_levels(3),
+        starvation_interval(32), collect_stats(true), trace_capacity(0) {
+    }
+};
 
 class thread_pool {
     typedef function_wrapper task_type;
 
+    struct worker_locality {
+        std::vector<unsigned> steal_order;
+        std::vector<cpu_distance> steal_distance;
+        std::atomic<std::uint64_t> steals[cpu_distance_count];
+
+        worker_locality() {
+            for (unsigned d = 0; d < cpu_distance_count; ++d) {
+                steals[d].store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
     std::atomic_bool done;
+    std::atomic_bool draining;
+    std::atomic_bool stopping;
+    // Workers with nothing left to do during a drain; drain_finished once
+    // all of them are.
+    std::atomic<unsigned> drain_idle;
+    static unsigned const drain_finished = ~0u;
+    event_count work_available;
     thread_safe_queue<task_type> pool_work_queue;
+    std::atomic<std::size_t> pool_queue_size;
     std::vector<std::unique_ptr<work_stealing_queue>> queues;
+    std::vector<std::unique_ptr<worker_locality>> locality;
+
+    struct priority_lane {
+        typedef std::chrono::steady_clock clock;
+
+        std::mutex m;
+        std::deque<std::pair<task_type, clock::time_point>> tasks;
+        std::atomic<std::size_t> size;
+        log2_histogram depth;
+        log2_histogram wait_ns;
+
+        priority_lane():
+            size(0) {
+        }
+
+        void push(task_type task) {
+            std::lock_guard<std::mutex> lk(m);
+            tasks.push_back(std::make_pair(std::move(task), clock::now()));
+            std::size_t const depth_now = tasks.size();
+            size.store(depth_now, std::memory_order_release);
+            depth.record(depth_now);
+        }
+
+        bool try_pop(task_type &task) {
+            if (!size.load(std::memory_order_acquire)) {
+                return false;
+            }
+            clock::time_point enqueued;
+            {
+                std::lock_guard<std::mutex> lk(m);
+                if (tasks.empty()) {
+                    return false;
+                }
+                task = std::move(tasks.front().first);
+                enqueued = tasks.front().second;
+                tasks.pop_front();
+                size.store(tasks.size(), std::memory_order_release);
+            }
+            wait_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                clock::now() - enqueued).count());
+            return true;
+        }
+    };
+
+    std::vector<std::unique_ptr<priority_lane>> lanes;
+    unsigned const normal_priority;
+    unsigned const starvation_interval;
+
+    typedef std::chrono::steady_clock clock;
+
+    std::vector<std::unique_ptr<worker_counters>> counters;
+    std::vector<std::unique_ptr<trace_buffer>> traces;
+    bool const collect_stats;
+    clock::time_point const start_time;
+
+    unsigned min_threads;
+    unsigned max_threads;
+    std::chrono::milliseconds const idle_timeout;
+    std::atomic<unsigned> active_workers;
+    std::unique_ptr<std::atomic<bool>[]> slot_active;
+    std::vector<unsigned> worker_cpus;
+    std::mutex resize_mutex;
+    std::mutex shutdown_mutex;
+
     std::vector<std::thread> threads;
     join_threads joiner;
 
+    static unsigned const idle_spin_count = 64;
+    static unsigned const grow_check_interval = 16;
+
+    static thread_local thread_pool* local_pool;
     static thread_local work_stealing_queue* local_work_queue;
     static thread_local unsigned my_index;
+    static thread_local unsigned tasks_since_starvation_check;
+    static thread_local unsigned starvation_lane;
+    static thread_local unsigned nested_task_depth;
+    static thread_local unsigned pushes_since_grow_check;
 
     void worker_thread(unsigned my_index_) {
+        local_pool = this;
         my_index = my_index_;
         local_work_queue = queues[my_index].get();
+        unsigned idle_spins = 0;
         while (!done) {
-            run_pending_task();
+            if (try_run_pending_task()) {
+                idle_spins = 0;
+            } else if (draining) {
+                if (wait_while_draining()) {
+                    break;
+                }
+            } else if (++idle_spins < idle_spin_count) {
+                std::this_thread::yield();
+            } else {
+                clock::time_point const parked = clock::now();
+                bool const woken = wait_for_work();
+                count(counter_parks);
+                count(counter_idle_ns, nanoseconds_since(parked));
+                if (!woken && try_retire()) {
+                    break;
+                }
+                idle_spins = 0;
+            }
+        }
+        local_pool = nullptr;
+    }
+
+    void start_worker(unsigned index) {
+        slot_active[index].store(true);
+        active_workers.fetch_add(1);
+        try {
+            threads[index] = std::thread(&thread_pool::worker_thread, this, index);
+        } catch (...) {
+            active_workers.fetch_sub(1);
+            slot_active[index].store(false);
+            throw;
+        }
+        if (!worker_cpus.empty()) {
+            pin_thread_to_cpu(threads[index], worker_cpus[index]);
+        }
+    }
+
+    bool try_retire() {
+        std::lock_guard<std::mutex> lk(resize_mutex);
+        if (stopping || active_workers.load() <= min_threads) {
+            return false;
+        }
+        active_workers.fetch_sub(1);
+        slot_active[my_index].store(false);
+        return true;
+    }
+
+    std::size_t backlog() const {
+        std::size_t res = pool_queue_size.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < lanes.size(); ++i) {
+            res += lanes[i]->size.load(std::memory_order_relaxed);
+        }
+        for (unsigned i = 0; i < queues.size(); ++i) {
+            res += queues[i]->size();
+        }
+        return res;
+    }
+
+    // Called after queueing work. Adds a worker when none is parked and
+    // more tasks are queued than there are workers to run them.
+    void maybe_grow() {
+        if (active_workers.load(std::memory_order_relaxed) >= max_threads ||
+            work_available.waiters() || stopping) {
+            return;
+        }
+        if (++pushes_since_grow_check < grow_check_interval) {
+            return;
+        }
+        pushes_since_grow_check = 0;
+        if (backlog() <= active_workers.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lk(resize_mutex, std::try_to_lock);
+        if (!lk.owns_lock() || stopping ||
+            active_workers.load() >= max_threads) {
+            return;
+        }
+        for (unsigned i = 0; i < max_threads; ++i) {
+            if (!slot_active[i].load()) {
+                // A retired worker has already left its loop; reap it
+                // before reusing the slot.
+                if (threads[i].joinable()) {
+                    threads[i].join();
+                }
+                start_worker(i);
+                return;
+            }
+        }
+    }
+
+    void check_accepting() const {
+        if (stopping && !on_worker_thread()) {
+            throw std::runtime_error("thread_pool has been shut down");
+        }
+    }
+
+    void push_to_pool_queue(task_type task) {
+        pool_queue_size.fetch_add(1, std::memory_order_relaxed);
+        pool_work_queue.push(std::move(task));
+    }
+
+    void cancel_pending_tasks() {
+        task_type task;
+        while (pop_task_from_pool_queue(task)) {
+            task.cancel();
+        }
+        for (unsigned p = 0; p < lanes.size(); ++p) {
+            while (lanes[p]->try_pop(task)) {
+                task.cancel();
+            }
+        }
+        for (unsigned i = 0; i < queues.size(); ++i) {
+            while (queues[i]->try_steal(task)) {
+                task.cancel();
+            }
+        }
+    }
+
+    bool has_pending_work() {
+        if (!pool_work_queue.empty()) {
+            return true;
+        }
+        for (unsigned i = 0; i < lanes.size(); ++i) {
+            if (lanes[i]->size.load(std::memory_order_acquire)) {
+                return true;
+            }
+        }
+        for (unsigned i = 0; i < queues.size(); ++i) {
+            if (!queues[i]->empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // A worker that runs dry during a drain must not leave while tasks on
+    // other workers may still spawn work, or that work would run serially
+    // on whoever spawned it. It counts itself idle and waits; it goes back
+    // to work if some turns up, and everyone leaves once the last worker
+    // goes idle. Work only appears from a running task, and a worker only
+    // goes idle after failing to find any, so at that point none is left.
+    // Returns true when the drain is over.
+    bool wait_while_draining() {
+        unsigned const workers = active_workers.load();
+        unsigned idle = drain_idle.fetch_add(1) + 1;
+        for (;;) {
+            if (idle == drain_finished) {
+                return true;
+            }
+            if (idle == workers && !has_pending_work()) {
+                if (drain_idle.compare_exchange_strong(idle, drain_finished)) {
+                    return true;
+                }
+                continue;
+            }
+            if (has_pending_work()) {
+                // Leave the idle count before taking the work, unless the
+                // drain has already been declared over.
+                while (idle != drain_finished) {
+                    if (drain_idle.compare_exchange_weak(idle, idle - 1)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            std::this_thread::yield();
+            idle = drain_idle.load();
+        }
+    }
+
+    // Returns false if the worker may retire: it is above min_threads and
+    // waited idle_timeout without being woken.
+    bool wait_for_work() {
+        event_count::key const key = work_available.prepare_wait();
+        if (done || draining || has_pending_work()) {
+            work_available.cancel_wait();
+            return true;
+        }
+        if (active_workers.load(std::memory_order_relaxed) > min_threads) {
+            return work_available.commit_wait_for(key, idle_timeout);
+        }
+        work_available.commit_wait(key);
+        return true;
+    }
+
+    std::uint64_t nanoseconds_since(clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock::now() - t).count();
+    }
+
+    void count(worker_counter c, std::uint64_t n = 1) {
+        if (collect_stats && on_worker_thread()) {
+            counters[my_index]->add(c, n);
+        }
+    }
+
+    void run_task(task_type &task) {
+        if (!on_worker_thread() || (!collect_stats && traces.empty())) {
+            task();
+            return;
+        }
+        // A task that waits cooperatively runs others inside it; only the
+        // outermost one adds to busy time so that nothing is counted twice.
+        std::uint64_t const begin = nanoseconds_since(start_time);
+        ++nested_task_depth;
+        task();
+        --nested_task_depth;
+        std::uint64_t const end = nanoseconds_since(start_time);
+        count(counter_tasks_run);
+        if (!nested_task_depth) {
+            count(counter_busy_ns, end - begin);
+        }
+        if (!traces.empty()) {
+            traces[my_index]->record(begin, end);
         }
     }
 
     bool pop_task_from_local_queue(task_type& task) {
-        return local_work_queue && local_work_queue->try_pop(task);
+        if (on_worker_thread() && local_work_queue->try_pop(task)) {
+            count(counter_local_pops);
+            return true;
+        }
+        return false;
     }
 
     bool pop_task_from_pool_queue(task_type& task) {
-        return pool_work_queue.try_pop(task);
+        if (pool_work_queue.try_pop(task)) {
+            pool_queue_size.fetch_sub(1, std::memory_order_relaxed);
+            count(counter_global_pops);
+            return true;
+        }
+        return false;
+    }
+
+    bool pop_task_from_lanes(task_type &task, unsigned first, unsigned last) {
+        for (unsigned p = first; p < last; ++p) {
+            if (lanes[p]->try_pop(task)) {
+                count(counter_lane_pops);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool pop_starving_task(task_type &task) {
+        if (++tasks_since_starvation_check < starvation_interval) {
+            return false;
+        }
+        tasks_since_starvation_check = 0;
+        for (unsigned i = 0; i < lanes.size(); ++i) {
+            unsigned const p = starvation_lane++ % lanes.size();
+            // The normal level's work lives in the plain queues.
+            if (p == normal_priority ? pop_plain_task(task) :
+                pop_task_from_lanes(task, p, p + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool pop_plain_task(task_type &task) {
+        return pop_task_from_local_queue(task) ||
+            pop_task_from_pool_queue(task) ||
+            pop_task_from_other_thread_queue(task);
     }
 
     bool pop_task_from_other_thread_queue(task_type &task) {
+        if (on_worker_thread()) {
+            worker_locality &self = *locality[my_index];
+            for (unsigned i = 0; i < self.steal_order.size(); ++i) {
+                if (queues[self.steal_order[i]]->try_steal(task)) {
+                    self.steals[self.steal_distance[i]].fetch_add(
+                        1, std::memory_order_relaxed);
+                    count(counter_steals);
+                    return true;
+                }
+            }
+            return false;
+        }
+
         for (unsigned i = 0; i < queues.size(); ++i) {
-            unsigned const index = (my_index + i + 1) % queues.size();
-            if (queues[index]->try_steal(task)) {
+            if (queues[i]->try_steal(task)) {
                 return true;
             }
         }
-
         return false;
     }
+
+    // Victims sorted nearest first; within one distance the original
+    // rotation starting at my_index + 1 is kept, so thieves spread out.
+    // Unpinned workers can run anywhere, so for them every victim counts
+    // as remote and only the rotation remains.
+    void build_steal_orders(cpu_topology const &topology, bool pinned) {
+        unsigned const count = queues.size();
+        for (unsigned me = 0; me < count; ++me) {
+            std::vector<std::pair<cpu_distance, unsigned>> victims;
+            for (unsigned i = 1; i < count; ++i) {
+                unsigned const other = (me + i) % count;
+                cpu_distance const d = pinned ?
+                    cpu_topology::distance(topology[me % topology.size()],
+                                           topology[other % topology.size()]) :
+                    remote_numa_node;
+                victims.push_back(std::make_pair(d, i));
+            }
+            std::sort(victims.begin(), victims.end());
+
+            worker_locality &l = *locality[me];
+            for (unsigned i = 0; i < victims.size(); ++i) {
+                l.steal_order.push_back((me + victims[i].second) % count);
+                l.steal_distance.push_back(victims[i].first);
+            }
+        }
+    }
+
+    void push_task(task_type task) {
+        if (on_worker_thread()) {
+            local_work_queue->push(std::move(task));
+        } else {
+            push_to_pool_queue(std::move(task));
+        }
+        work_available.notify();
+        maybe_grow();
+    }
+
+    void distribute_tasks(std::vector<task_type> &tasks) {
+        if (on_worker_thread()) {
+            for (unsigned i = 0; i < tasks.size(); ++i) {
+                local_work_queue->push(std::move(tasks[i]));
+            }
+        } else {
+            for (unsigned i = 0; i < tasks.size(); ++i) {
+                push_to_pool_queue(std::move(tasks[i]));
+            }
+        }
+        work_available.notify_all();
+        maybe_grow();
+    }
+
+    // Carries a whole batch through pool_work_queue as a single entry; the
+    // worker that picks it up spills the batch onto its own queue, and the
+    // other workers take their share by stealing.
+    struct bulk_distributor {
+        thread_pool *pool;
+        std::vector<task_type> tasks;
+
+        void operator()() {
+            pool->distribute_tasks(tasks);
+        }
+
+        void cancel() {
+            for (unsigned i = 0; i < tasks.size(); ++i) {
+                tasks[i].cancel();
+            }
+        }
+    };
+
+    void push_bulk(std::vector<task_type> tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+        if (on_worker_thread()) {
+            distribute_tasks(tasks);
+        } else {
+            bulk_distributor distributor = {this, std::move(tasks)};
+            push_to_pool_queue(task_type(std::move(distributor)));
+            work_available.notify();
+            maybe_grow();
+        }
+    }
+
+    template <typename Iterator, typename FunctionType>
+    struct bulk_call {
+        typedef typename std::result_of<FunctionType(
+            typename std::iterator_traits<Iterator>::reference)>::type
+            result_type;
+
+        FunctionType f;
+        Iterator it;
+
+        result_type operator()() {
+            return f(*it);
+        }
+    };
+
+    template <typename Index, typename FunctionType>
+    struct parallel_for_state {
+        FunctionType f;
+        std::atomic<std::size_t> remaining;
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+        std::promise<void> done;
+
+        parallel_for_state(FunctionType &&f_, std::size_t chunks):
+            f(std::move(f_)), remaining(chunks), failed(false) {
+        }
+
+        void fail(std::exception_ptr e) {
+            if (!failed.exchange(true)) {
+                error = e;
+            }
+        }
+
+        void run_chunk(Index first, Index last) {
+            try {
+                for (Index i = first; i != last; ++i) {
+                    f(i);
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            chunk_done();
+        }
+
+        void cancel_chunk() {
+            fail(std::make_exception_ptr(task_cancelled()));
+            chunk_done();
+        }
+
+        void chunk_done() {
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (error) {
+                    done.set_exception(error);
+                } else {
+                    done.set_value();
+                }
+                delete this;
+            }
+        }
+    };
+
+    template <typename Index, typename FunctionType>
+    struct parallel_for_chunk {
+        parallel_for_state<Index, FunctionType> *state;
+        Index first;
+        Index last;
+
+        void operator()() {
+            state->run_chunk(first, last);
+        }
+
+        void cancel() {
+            state->cancel_chunk();
+        }
+    };
 public:
-    thread_pool():
-        done(false), joiner(threads) {
-        unsigned const thread_count = std::thread::hardware_concurrency();
+    explicit thread_pool(
+            thread_pool_options const &options = thread_pool_options()):
+        done(false), draining(false), stopping(false), drain_idle(0),
+        pool_queue_size(0),
+        normal_priority(std::max(1u, options.priority_levels) / 2),
+        starvation_interval(std::max(1u, options.starvation_interval)),
+        collect_stats(options.collect_stats),
+        start_time(clock::now()),
+        idle_timeout(options.idle_timeout),
+        active_workers(0),
+        joiner(threads) {
+        unsigned const requested = std::max(1u, options.thread_count ?
+            options.thread_count : std::thread::hardware_concurrency());
+        min_threads = std::max(1u, options.min_threads ?
+            options.min_threads : requested);
+        max_threads = std::max(min_threads, options.max_threads ?
+            options.max_threads : requested);
+        unsigned const initial_threads =
+            std::min(std::max(requested, min_threads), max_threads);
+        cpu_topology const topology = cpu_topology::detect();
+        bool const pinned = options.pin_threads && topology.size() > 0;
+
+        // Every slot a worker may ever occupy is set up front, so thieves
+        // and the stats never see these vectors change.
+        slot_active.reset(new std::atomic<bool>[max_threads]);
+        threads.resize(max_threads);
+        for (unsigned i = 0; i < max_threads; ++i) {
+            slot_active[i].store(false);
+            if (pinned) {
+                worker_cpus.push_back(topology[i % topology.size()].cpu);
+            }
+            queues.push_back(std::unique_ptr<work_stealing_queue>(new work_stealing_queue));
+            locality.push_back(std::unique_ptr<worker_locality>(new worker_locality));
+            counters.push_back(std::unique_ptr<worker_counters>(new worker_counters));
+            if (options.trace_capacity) {
+                traces.push_back(std::unique_ptr<trace_buffer>(
+                    new trace_buffer(options.trace_capacity)));
+            }
+        }
+        build_steal_orders(topology, pinned);
+        for (unsigned p = 0; p < std::max(1u, options.priority_levels); ++p) {
+            lanes.push_back(std::unique_ptr<priority_lane>(new priority_lane));
+        }
 
         try {
-            for (unsigned i = 0; i < thread_count; ++i) {
-                queues.push_back(std::unique_ptr<work_stealing_queue>(new work_stealing_queue));
-                threads.push_back(std::thread(&thread_pool::worker_thread, this, i));
+            for (unsigned i = 0; i < initial_threads; ++i) {
+                start_worker(i);
             }
         } catch (...) {
             done = true;
+            work_available.notify_all();
             throw;
         }
     }
 
     ~thread_pool() {
+        shutdown(shutdown_mode::drain);
+    }
+
+    // Stops accepting work from outside the pool and joins every worker.
+    // Tasks already running may still queue more work; with drain that work
+    // runs too. Must not be called from one of the pool's own workers.
+    void shutdown(shutdown_mode mode = shutdown_mode::drain) {
+        if (on_worker_thread()) {
+            throw std::logic_error("thread_pool::shutdown called from a worker");
+        }
+        std::lock_guard<std::mutex> shutdown_lk(shutdown_mutex);
+        {
+            std::lock_guard<std::mutex> lk(resize_mutex);
+            stopping = true;
+            if (mode == shutdown_mode::drain) {
+                draining = true;
+            } else {
+                done = true;
+            }
+        }
+        work_available.notify_all();
+        for (unsigned i = 0; i < threads.size(); ++i) {
+            if (threads[i].joinable()) {
+                threads[i].join();
+            }
+        }
         done = true;
+
+        if (mode == shutdown_mode::drain) {
+            while (try_run_pending_task()) {
+            }
+        } else {
+            cancel_pending_tasks();
+        }
+    }
+
+    unsigned thread_count() const {
+        return active_workers.load(std::memory_order_relaxed);
     }
-    
+
     template<typename FunctionType>
-    std::future<typename std::result_of<FunctionType()>::type> submit(FunctionType f) {
+    task_future<typename std::result_of<FunctionType()>::type> submit(FunctionType f) {
         typedef typename std::result_of<FunctionType()>::type result_type;
 
-        std::packaged_task<result_type()> task(f);
-        std::future<result_type> res(task.get_future());
-        if (local_work_queue) {
-            local_work_queue->push(std::move(task));
-        } else {
-            pool_work_queue.push(std::move(task));
+        check_accepting();
+        fused_task<result_type, FunctionType> task(std::move(f));
+        task_future<result_type> res(task.get_future());
+        push_task(std::move(task));
+        return res;
+    }
+
+    // Lower numbers are more urgent; priorities past the last lane are
+    // clamped to it. normal_priority work goes where submit(f) puts it.
+    template<typename FunctionType>
+    task_future<typename std::result_of<FunctionType()>::type>
+    submit(unsigned priority, FunctionType f) {
+        typedef typename std::result_of<FunctionType()>::type result_type;
+
+        check_accepting();
+        fused_task<result_type, FunctionType> task(std::move(f));
+        task_future<result_type> res(task.get_future());
+        priority = std::min<std::size_t>(priority, lanes.size() - 1);
+        if (priority == normal_priority) {
+            push_task(task_type(std::move(task)));
+            return res;
         }
+        lanes[priority]->push(task_type(std::move(task)));
+        work_available.notify();
+        maybe_grow();
         return res;
     }
 
-    void run_pending_task() {
+    template <typename FunctionType>
+    void post(FunctionType f) {
+        check_accepting();
+        push_task(task_type(std::move(f)));
+    }
+
+    template <typename Iterator, typename FunctionType>
+    std::vector<std::future<typename std::result_of<FunctionType(
+        typename std::iterator_traits<Iterator>::reference)>::type>>
+    submit_bulk(Iterator first, Iterator last, FunctionType f) {
+        typedef bulk_call<Iterator, FunctionType> call_type;
+        typedef typename call_type::result_type result_type;
+
+        check_accepting();
+        std::vector<std::future<result_type>> res;
+        std::vector<task_type> tasks;
+        for (; first != last; ++first) {
+            call_type const call = {f, first};
+            fused_task<result_type, call_type> task(call);
+            res.push_back(task.get_future());
+            tasks.push_back(task_type(std::move(task)));
+        }
+        push_bulk(std::move(tasks));
+        return res;
+    }
+
+    template <typename Range, typename FunctionType>
+    std::vector<std::future<typename bulk_call<
+        decltype(std::declval<Range &>().begin()),
+        FunctionType>::result_type>>
+    submit_bulk(Range &range, FunctionType f) {
+        return submit_bulk(range.begin(), range.end(), std::move(f));
+    }
+
+    template <typename Index, typename FunctionType>
+    std::future<void> parallel_for(Index first, Index last, Index grain,
+                                   FunctionType f) {
+        typedef parallel_for_state<Index, FunctionType> state_type;
+        typedef parallel_for_chunk<Index, FunctionType> chunk_type;
+
+        check_accepting();
+        if (!(first < last)) {
+            std::promise<void> nothing_to_do;
+            nothing_to_do.set_value();
+            return nothing_to_do.get_future();
+        }
+        if (grain < Index(1)) {
+            grain = Index(1);
+        }
+
+        std::size_t const chunks =
+            std::size_t((last - first + grain - 1) / grain);
+        state_type *const state = new state_type(std::move(f), chunks);
+        std::future<void> res = state->done.get_future();
+
+        std::vector<task_type> tasks;
+        tasks.reserve(chunks);
+        for (Index lo = first; lo < last; ) {
+            Index const hi = (last - lo > grain) ? Index(lo + grain) : last;
+            chunk_type const chunk = {state, lo, hi};
+            tasks.push_back(task_type(chunk));
+            lo = hi;
+        }
+        push_bulk(std::move(tasks));
+        return res;
+    }
+
+    bool try_run_pending_task() {
         function_wrapper task;
-        if (pop_task_from_local_queue(task) || 
-            pop_task_from_pool_queue(task) || 
-            pop_task_from_other_thread_queue(task)) {
-            task();
-        } else {
+        if (pop_starving_task(task) ||
+            pop_task_from_lanes(task, 0, normal_priority) ||
+            pop_plain_task(task) ||
+            pop_task_from_lanes(task, normal_priority + 1, lanes.size())) {
+            run_task(task);
+            return true;
+        }
+        return false;
+    }
+
+    void run_pending_task() {
+        if (!try_run_pending_task()) {
             std::this_thread::yield();
         }
     }
+
+    // Counters are read without stopping the workers, so the snapshot is
+    // only approximately consistent across workers.
+    thread_pool_stats stats() const {
+        thread_pool_stats res;
+        for (unsigned i = 0; i < counters.size(); ++i) {
+            worker_stats w;
+            for (unsigned c = 0; c < worker_counter_count; ++c) {
+                w.counters[c] = counters[i]->get(worker_counter(c));
+            }
+            w.queue_depth = queues[i]->size();
+            res.workers.push_back(w);
+            res.total += w;
+        }
+        for (unsigned p = 0; p < lanes.size(); ++p) {
+            res.lane_depths.push_back(
+                lanes[p]->size.load(std::memory_order_relaxed));
+        }
+        return res;
+    }
+
+    // Writes the traced tasks of every worker as Chrome trace JSON.
+    void dump_trace(std::ostream &out) const {
+        std::vector<trace_buffer const *> buffers;
+        for (unsigned i = 0; i < traces.size(); ++i) {
+            buffers.push_back(traces[i].get());
+        }
+        write_chrome_trace(out, buffers);
+    }
+
+    unsigned priority_levels() const {
+        return lanes.size();
+    }
+
+    // Depth of the lane sampled at every push.
+    histogram_snapshot queue_depth_histogram(unsigned priority) const {
+        return lanes[std::min<std::size_t>(priority, lanes.size() - 1)]->depth.snapshot();
+    }
+
+    // Nanoseconds between push and pop for tasks in the lane.
+    histogram_snapshot wait_time_histogram(unsigned priority) const {
+        return lanes[std::min<std::size_t>(priority, lanes.size() - 1)]->wait_ns.snapshot();
+    }
+
+    // Successful steals by all workers, indexed by cpu_distance.
+    std::vector<std::uint64_t> steal_distance_counts() const {
+        std::vector<std::uint64_t> res(cpu_distance_count, 0);
+        for (unsigned i = 0; i < locality.size(); ++i) {
+            for (unsigned d = 0; d < cpu_distance_count; ++d) {
+                res[d] += locality[i]->steals[d].load(std::memory_order_relaxed);
+            }
+        }
+        return res;
+    }
+
+    bool on_worker_thread() const {
+        return local_pool == this;
+    }
+
+    // Waiting from inside a task would otherwise tie up a worker, and with
+    // enough nested waits every worker ends up blocked on work that nobody
+    // is left to run. A worker keeps running pending tasks until the future
+    // is ready; any other thread simply blocks.
+    template <typename ResultType>
+    void wait(std::future<ResultType> const &f) {
+        if (!on_worker_thread()) {
+            f.wait();
+            return;
+        }
+        while (f.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready) {
+            run_pending_task();
+        }
+    }
+
+    template <typename ResultType>
+    ResultType get(std::future<ResultType> &f) {
+        wait(f);
+        return f.get();
+    }
 };
+
+class task_group {
+    thread_pool &pool;
+    std::atomic<std::size_t> pending;
+    // Tasks still inside task_done; the group must outlive them even
+    // after pending has reached zero.
+    std::atomic<std::size_t> finishing;
+    std::atomic<bool> failed;
+    std::exception_ptr error;
+    event_count all_done;
+
+    template <typename FunctionType>
+    struct group_task {
+        task_group *group;
+        FunctionType f;
+
+        void operator()() {
+            try {
+                f();
+            } catch (...) {
+                if (!group->failed.exchange(true)) {
+                    group->error = std::current_exception();
+                }
+            }
+            group->task_done();
+        }
+
+        void cancel() {
+            if (!group->failed.exchange(true)) {
+                group->error = std::make_exception_ptr(task_cancelled());
+            }
+            group->task_done();
+        }
+    };
+
+    void task_done() {
+        finishing.fetch_add(1, std::memory_order_relaxed);
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            all_done.notify_all();
+        }
+        finishing.fetch_sub(1, std::memory_order_release);
+    }
+
+    // A waiter that saw pending reach zero may destroy the group as soon
+    // as it returns, so it first lets the last task_done finish notifying.
+    void wait_for_finishing() {
+        while (finishing.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    void wait_for_tasks() {
+        if (pool.on_worker_thread()) {
+            while (pending.load(std::memory_order_acquire)) {
+                pool.run_pending_task();
+            }
+            wait_for_finishing();
+            return;
+        }
+        while (pending.load(std::memory_order_acquire)) {
+            event_count::key const key = all_done.prepare_wait();
+            if (!pending.load(std::memory_order_acquire)) {
+                all_done.cancel_wait();
+                break;
+            }
+            all_done.commit_wait(key);
+        }
+        wait_for_finishing();
+    }
+
+public:
+    explicit task_group(thread_pool &pool_):
+        pool(pool_), pending(0), finishing(0), failed(false) {
+    }
+
+    task_group(task_group const &) = delete;
+    task_group &operator=(task_group const &) = delete;
+
+    ~task_group() {
+        wait_for_tasks();
+    }
+
+    template <typename FunctionType>
+    void run(FunctionType f) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        group_task<FunctionType> task = {this, std::move(f)};
+        try {
+            pool.post(std::move(task));
+        } catch (...) {
+            // Not queued (the pool is shutting down), so nothing else will
+            // ever count it off.
+            task_done();
+            throw;
+        }
+    }
+
+    // Rethrows the first exception thrown by any task in the group.
+    void wait() {
+        wait_for_tasks();
+        if (failed.exchange(false)) {
+            std::exception_ptr e;
+            std::swap(e, error);
+            std::rethrow_exception(e);
+        }
+    }
+};
+
+thread_local thread_pool* thread_pool::local_pool = nullptr;
+thread_local work_stealing_queue* thread_pool::local_work_queue = nullptr;
+thread_local unsigned thread_pool::my_index = 0;
+thread_local unsigned thread_pool::tasks_since_starvation_check = 0;
+thread_local unsigned thread_pool::starvation_lane = 0;
+thread_local unsigned thread_pool::nested_task_depth = 0;
+thread_local unsigned thread_pool::pushes_since_grow_check = 0;
@@ -0,0 +1,77 @@
+#ifndef POOL_STATS_H
+#define POOL_STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum worker_counter {
+    counter_tasks_run,
+    counter_local_pops,
+    counter_global_pops,
+    counter_lane_pops,
+    counter_steals,
+    counter_busy_ns,
+    counter_idle_ns,
+    counter_parks,
+    worker_counter_count
+};
+
+// Counters owned by one worker. Only that worker writes them, so an update
+// is a plain load and store; the padding keeps neighbouring workers' counters
+// off this cache line.
+class worker_counters {
+    static std::size_t const cache_line_size = 64;
+
+    char pad_front[cache_line_size];
+    std::atomic<std::uint64_t> values[worker_counter_count];
+    char pad_back[cache_line_size];
+
+public:
+    worker_counters() {
+        for (unsigned i = 0; i < worker_counter_count; ++i) {
+            values[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    worker_counters(worker_counters const &) = delete;
+    worker_counters &operator=(worker_counters const &) = delete;
+
+    void add(worker_counter c, std::uint64_t n) {
+        values[c].store(values[c].load(std::memory_order_relaxed) + n,
+                        std::memory_order_relaxed);
+    }
+
+    std::uint64_t get(worker_counter c) const {
+        return values[c].load(std::memory_order_relaxed);
+    }
+};
+
+struct worker_stats {
+    std::uint64_t counters[worker_counter_count];
+    std::size_t queue_depth;
+
+    worker_stats():
+        queue_depth(0) {
+        for (unsigned i = 0; i < worker_counter_count; ++i) {
+            counters[i] = 0;
+        }
+    }
+
+    worker_stats &operator+=(worker_stats const &other) {
+        for (unsigned i = 0; i < worker_counter_count; ++i) {
+            counters[i] += other.counters[i];
+        }
+        queue_depth += other.queue_depth;
+        return *this;
+    }
+};
+
+struct thread_pool_stats {
+    std::vector<worker_stats> workers;
+    worker_stats total;
+    std::vector<std::size_t> lane_depths;
+};
+
+#endif
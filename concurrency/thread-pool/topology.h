@@ -0,0 +1,176 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// How far apart two logical CPUs are, nearest first.
+enum cpu_distance {
+    smt_sibling = 0,
+    shared_llc = 1,
+    same_numa_node = 2,
+    remote_numa_node = 3,
+    cpu_distance_count = 4
+};
+
+struct cpu_info {
+    unsigned cpu;
+    int core_id;
+    int llc_id;
+    int node_id;
+};
+
+// Logical CPUs as described by /sys/devices/system/cpu. Each group id is the
+// lowest-numbered CPU in that group. When sysfs is unavailable every CPU is
+// treated as its own core, cache and node.
+class cpu_topology {
+    std::vector<cpu_info> cpus;
+
+    static std::string read_line(std::string const &path) {
+        std::ifstream in(path.c_str());
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    // Parses the kernel's cpulist format, e.g. "0-3,8,10-11".
+    static std::vector<unsigned> parse_cpu_list(std::string const &list) {
+        std::vector<unsigned> res;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty()) {
+                continue;
+            }
+            std::string::size_type const dash = range.find('-');
+            unsigned const first = std::strtoul(range.c_str(), nullptr, 10);
+            unsigned const last = (dash == std::string::npos) ? first :
+                std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+            for (unsigned cpu = first; cpu <= last; ++cpu) {
+                res.push_back(cpu);
+            }
+        }
+        return res;
+    }
+
+    static int first_of(std::string const &list, unsigned fallback) {
+        std::vector<unsigned> const group = parse_cpu_list(list);
+        return group.empty() ? int(fallback) :
+            int(*std::min_element(group.begin(), group.end()));
+    }
+
+    static int read_llc_id(std::string const &cpu_dir, unsigned cpu) {
+        int best_level = 0;
+        int id = int(cpu);
+        for (unsigned index = 0; ; ++index) {
+            std::ostringstream dir;
+            dir << cpu_dir << "/cache/index" << index;
+            std::string const level = read_line(dir.str() + "/level");
+            if (level.empty()) {
+                break;
+            }
+            std::string const type = read_line(dir.str() + "/type");
+            int const l = std::atoi(level.c_str());
+            if (type != "Instruction" && l > best_level) {
+                best_level = l;
+                id = first_of(read_line(dir.str() + "/shared_cpu_list"), cpu);
+            }
+        }
+        return id;
+    }
+
+    static int read_node_id(std::string const &cpu_dir) {
+        int node = 0;
+#if defined(__linux__)
+        DIR *dir = opendir(cpu_dir.c_str());
+        if (dir != NULL) {
+            struct dirent *dent;
+            while ((dent = readdir(dir)) != NULL) {
+                std::string const name(dent->d_name);
+                if (name.compare(0, 4, "node") == 0 && name.size() > 4 &&
+                    name[4] >= '0' && name[4] <= '9') {
+                    node = std::atoi(name.c_str() + 4);
+                    break;
+                }
+            }
+            closedir(dir);
+        }
+#endif
+        return node;
+    }
+
+public:
+    static cpu_topology detect() {
+        cpu_topology res;
+        std::string const root = "/sys/devices/system/cpu";
+        std::vector<unsigned> online = parse_cpu_list(read_line(root + "/online"));
+        if (online.empty()) {
+            unsigned const n = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned cpu = 0; cpu < n; ++cpu) {
+                cpu_info const info = {cpu, int(cpu), int(cpu), int(cpu)};
+                res.cpus.push_back(info);
+            }
+            return res;
+        }
+        for (unsigned i = 0; i < online.size(); ++i) {
+            unsigned const cpu = online[i];
+            std::ostringstream dir;
+            dir << root << "/cpu" << cpu;
+            cpu_info info;
+            info.cpu = cpu;
+            info.core_id = first_of(
+                read_line(dir.str() + "/topology/thread_siblings_list"), cpu);
+            info.llc_id = read_llc_id(dir.str(), cpu);
+            info.node_id = read_node_id(dir.str());
+            res.cpus.push_back(info);
+        }
+        return res;
+    }
+
+    std::size_t size() const {
+        return cpus.size();
+    }
+
+    cpu_info const &operator[](std::size_t i) const {
+        return cpus[i];
+    }
+
+    static cpu_distance distance(cpu_info const &a, cpu_info const &b) {
+        if (a.core_id == b.core_id) {
+            return smt_sibling;
+        }
+        if (a.llc_id == b.llc_id) {
+            return shared_llc;
+        }
+        if (a.node_id == b.node_id) {
+            return same_numa_node;
+        }
+        return remote_numa_node;
+    }
+};
+
+inline bool pin_thread_to_cpu(std::thread &t, unsigned cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void)t;
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
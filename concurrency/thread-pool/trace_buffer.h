@@ -0,0 +1,88 @@
+#ifndef TRACE_BUFFER_H
+#define TRACE_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+// Fixed-size ring of task begin/end timestamps written by a single thread.
+// Once full, the oldest events are overwritten. Fields are relaxed atomics
+// so that a reader can dump the ring while the writer keeps going; an event
+// being overwritten during the dump may come out mixed with its successor.
+class trace_buffer {
+    std::size_t const capacity;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> begin_ns;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> end_ns;
+    std::atomic<std::uint64_t> written;
+
+public:
+    explicit trace_buffer(std::size_t capacity_):
+        capacity(capacity_),
+        begin_ns(new std::atomic<std::uint64_t>[capacity_]),
+        end_ns(new std::atomic<std::uint64_t>[capacity_]),
+        written(0) {
+    }
+
+    trace_buffer(trace_buffer const &) = delete;
+    trace_buffer &operator=(trace_buffer const &) = delete;
+
+    void record(std::uint64_t begin, std::uint64_t end) {
+        std::uint64_t const n = written.load(std::memory_order_relaxed);
+        std::size_t const slot = std::size_t(n % capacity);
+        begin_ns[slot].store(begin, std::memory_order_relaxed);
+        end_ns[slot].store(end, std::memory_order_relaxed);
+        written.store(n + 1, std::memory_order_release);
+    }
+
+    template <typename Function>
+    void for_each(Function f) const {
+        std::uint64_t const n = written.load(std::memory_order_acquire);
+        std::uint64_t const first = n > capacity ? n - capacity : 0;
+        for (std::uint64_t i = first; i < n; ++i) {
+            std::size_t const slot = std::size_t(i % capacity);
+            f(begin_ns[slot].load(std::memory_order_relaxed),
+              end_ns[slot].load(std::memory_order_relaxed));
+        }
+    }
+};
+
+// Trace timestamps are microseconds; writing the whole part and the three
+// nanosecond digits separately keeps full precision whatever the stream's
+// floating-point settings.
+inline void write_microseconds(std::ostream &out, std::uint64_t ns) {
+    char const fraction[] = {
+        char('0' + ns / 100 % 10), char('0' + ns / 10 % 10),
+        char('0' + ns % 10), '\0'};
+    out << ns / 1000 << '.' << fraction;
+}
+
+// Writes one complete ("X") event per recorded task in the Chrome trace
+// event format, with one track per worker. Load the output in
+// chrome://tracing or Perfetto.
+inline void write_chrome_trace(
+        std::ostream &out,
+        std::vector<trace_buffer const *> const &workers) {
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (std::size_t w = 0; w < workers.size(); ++w) {
+        if (!workers[w]) {
+            continue;
+        }
+        workers[w]->for_each([&](std::uint64_t begin, std::uint64_t end) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            out << "{\"name\":\"task\",\"ph\":\"X\",\"pid\":0,\"tid\":" << w
+                << ",\"ts\":";
+            write_microseconds(out, begin);
+            out << ",\"dur\":";
+            write_microseconds(out, end - begin);
+            out << "}";
+        });
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+#endif
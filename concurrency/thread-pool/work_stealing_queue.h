@@ -1,46 +1,171 @@
+#ifndef WORK_STEALING_QUEUE_H
+#define WORK_STEALING_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
 #include "function_wrapper.h"
 
+// Chase-Lev deque (with the memory orderings from Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models"). push and try_pop may only
+// be called by the owning thread; any thread may call try_steal.
+//
+// Tasks are stored by value: each slot holds the raw words of a relocated
+// function_wrapper. A thief copies the words out before it has won the
+// slot and only adopts them if its CAS on top succeeds.
 class work_stealing_queue {
 private:
 	typedef function_wrapper data_type;
-	std::deque<data_type> the_queue;
-	mutable std::mutex the_mutex;
+	static std::size_t const slot_words = data_type::raw_words;
+
+	struct raw_slot {
+		std::uintptr_t words[slot_words];
+	};
+
+	class circular_array {
+		std::int64_t const log_size;
+		std::unique_ptr<std::atomic<std::uintptr_t>[]> words;
+
+	public:
+		explicit circular_array(std::int64_t log_size_):
+			log_size(log_size_),
+			words(new std::atomic<std::uintptr_t>[
+				(std::int64_t(1) << log_size_) * slot_words]) {
+		}
+
+		std::int64_t size() const {
+			return std::int64_t(1) << log_size;
+		}
+
+		void get(std::int64_t i, raw_slot& x) const {
+			std::atomic<std::uintptr_t> const* const slot =
+				&words[(i & (size() - 1)) * slot_words];
+			for (std::size_t w = 0; w < slot_words; ++w) {
+				x.words[w] = slot[w].load(std::memory_order_relaxed);
+			}
+		}
+
+		void put(std::int64_t i, raw_slot const& x) {
+			std::atomic<std::uintptr_t>* const slot =
+				&words[(i & (size() - 1)) * slot_words];
+			for (std::size_t w = 0; w < slot_words; ++w) {
+				slot[w].store(x.words[w], std::memory_order_relaxed);
+			}
+		}
+
+		circular_array* grow(std::int64_t bottom, std::int64_t top) const {
+			circular_array* const a = new circular_array(log_size + 1);
+			raw_slot x;
+			for (std::int64_t i = top; i != bottom; ++i) {
+				get(i, x);
+				a->put(i, x);
+			}
+			return a;
+		}
+	};
+
+	static std::size_t const cache_line_size = 64;
+
+	std::atomic<std::int64_t> top;
+	char pad[cache_line_size - sizeof(std::atomic<std::int64_t>)];
+	std::atomic<std::int64_t> bottom;
+	std::atomic<circular_array*> array;
+	// Thieves may still be reading from an array the owner has grown out of,
+	// so old arrays are only released with the queue itself.
+	std::vector<std::unique_ptr<circular_array>> old_arrays;
 
 public:
-	work_stealing_queue() {
+	explicit work_stealing_queue(std::int64_t log_initial_size = 8):
+		top(0), bottom(0), array(new circular_array(log_initial_size)) {
 	}
 
 	work_stealing_queue(const work_stealing_queue& other) = delete;
 	work_stealing_queue& operator=(const work_stealing_queue& other) = delete;
 
+	~work_stealing_queue() {
+		data_type res;
+		while (try_pop(res)) {
+		}
+		delete array.load(std::memory_order_relaxed);
+	}
+
 	void push(data_type data) {
-		std::lock_guard<std::mutex> lock(the_mutex);
-		the_queue.push_front(std::move(data));
+		std::int64_t const b = bottom.load(std::memory_order_relaxed);
+		std::int64_t const t = top.load(std::memory_order_acquire);
+		circular_array* a = array.load(std::memory_order_relaxed);
+		if (b - t > a->size() - 1) {
+			old_arrays.push_back(std::unique_ptr<circular_array>(a));
+			a = a->grow(b, t);
+			array.store(a, std::memory_order_release);
+		}
+		raw_slot x;
+		data.to_raw(x.words);
+		a->put(b, x);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
 	}
 
 	bool empty() const {
-		std::lock_guard<std::mutex> lock(the_mutex);
-		return the_queue.empty();
+		std::int64_t const b = bottom.load(std::memory_order_relaxed);
+		std::int64_t const t = top.load(std::memory_order_relaxed);
+		return b <= t;
+	}
+
+	// Approximate when called by anyone but the owner.
+	std::size_t size() const {
+		std::int64_t const b = bottom.load(std::memory_order_relaxed);
+		std::int64_t const t = top.load(std::memory_order_relaxed);
+		return b > t ? std::size_t(b - t) : 0;
+	}
 
 	bool try_pop(data_type& res) {
-		std::lock_guard<std::mutex> lock(the_mutex);
-		if (the_queue.empty()) {
+		std::int64_t const b = bottom.load(std::memory_order_relaxed) - 1;
+		circular_array* const a = array.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
 			return false;
 		}
 
-		res = std::move(the_queue.front());
-		the_queue.pop_front();
+		raw_slot x;
+		a->get(b, x);
+		if (t == b) {
+			// Last element: race the thieves for it.
+			bool const won = top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			if (!won) {
+				return false;
+			}
+		}
+
+		res.from_raw(x.words);
 		return true;
 	}
 
 	bool try_steal(data_type& res) {
-		std::lock_guard<std::mutex> lock(the_mutex);
-		if (the_queue.empty()) {
+		std::int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t const b = bottom.load(std::memory_order_acquire);
+		if (t >= b) {
 			return false;
 		}
 
-		res = std::move(the_queue.back());
-		the_queue.pop_back();
+		circular_array* const a = array.load(std::memory_order_acquire);
+		raw_slot x;
+		a->get(t, x);
+		if (!top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			return false;
+		}
+
+		res.from_raw(x.words);
 		return true;
 	}
-};
\ No newline at end of file
+};
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef FLAT_COMBINING_H
+#define FLAT_COMBINING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+
+// Flat combining after Hendler, Incze, Shavit and Tzafrir, around any
+// sequential container. apply(f) runs f(container) with exclusive access.
+// A caller that finds the lock free runs f itself; one that finds it
+// taken publishes f in a slot and spins on that slot, and whoever holds
+// the lock runs every published operation before letting go. Under
+// contention one thread then applies a batch with the container hot in
+// its cache, while the others each wait on a line nobody else writes,
+// instead of the lock and the container bouncing between all of them.
+//
+// f may run on another thread, so it hands results back through what it
+// captures by reference; an exception it throws is rethrown in the caller.
+template <typename Container>
+class flat_combining {
+private:
+    static std::size_t const cache_line = 64;
+    static unsigned const slot_count = 32;
+
+    enum slot_state { slot_free, slot_claimed, slot_pending, slot_done };
+
+    // run and context point into the publishing thread's frame, which
+    // waits until state is slot_done.
+    struct alignas(cache_line) slot {
+        std::atomic<unsigned> state;
+        void (*run)(void*, Container&);
+        void *context;
+        std::exception_ptr error;
+    };
+
+    // apply() const still publishes into the slots and lets the lock holder
+    // run everyone's operations, so the shared state is mutable.
+    mutable Container container;
+    mutable std::mutex m;
+    // new only guarantees alignof(std::max_align_t) before C++17, so the
+    // slots are placed in a buffer aligned by hand.
+    void *buffer;
+    slot *slots;
+    // Published and not yet run, so a lock holder with nothing to combine
+    // skips the scan.
+    mutable std::atomic<unsigned> pending;
+
+    template <typename Function>
+    static void invoke(void *context, Container &c) {
+        (*static_cast<Function*>(context))(c);
+    }
+
+    // Caller holds m.
+    void combine() const {
+        if (!pending.load(std::memory_order_acquire)) {
+            return;
+        }
+        for (unsigned i = 0; i < slot_count; ++i) {
+            slot &s = slots[i];
+            if (s.state.load(std::memory_order_acquire) != slot_pending) {
+                continue;
+            }
+            try {
+                s.run(s.context, container);
+            } catch (...) {
+                s.error = std::current_exception();
+            }
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            s.state.store(slot_done, std::memory_order_release);
+        }
+    }
+
+    slot &claim_slot() const {
+        thread_local static std::uint32_t seed = std::uint32_t(
+            reinterpret_cast<std::uintptr_t>(&seed) >> 4);
+        for (unsigned i = seed;; ++i) {
+            slot &s = slots[i % slot_count];
+            unsigned expected = slot_free;
+            if (s.state.load(std::memory_order_relaxed) == slot_free &&
+                s.state.compare_exchange_strong(expected, slot_claimed,
+                                                std::memory_order_acquire,
+                                                std::memory_order_relaxed)) {
+                return s;
+            }
+            if (i % slot_count == seed % slot_count) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+public:
+    template <typename... Args>
+    explicit flat_combining(Args &&... args):
+        container(std::forward<Args>(args)...),
+        buffer(::operator new(slot_count * sizeof(slot) + cache_line)),
+        slots(reinterpret_cast<slot*>(
+            (reinterpret_cast<std::uintptr_t>(buffer) + cache_line - 1) &
+            ~std::uintptr_t(cache_line - 1))),
+        pending(0) {
+        for (unsigned i = 0; i < slot_count; ++i) {
+            new (&slots[i]) slot();
+            slots[i].state.store(slot_free, std::memory_order_relaxed);
+        }
+    }
+
+    flat_combining(flat_combining const &) = delete;
+    flat_combining &operator=(flat_combining const &) = delete;
+
+    ~flat_combining() {
+        for (unsigned i = 0; i < slot_count; ++i) {
+            slots[i].~slot();
+        }
+        ::operator delete(buffer);
+    }
+
+private:
+    template <typename Function>
+    void run_exclusive(Function &f) const {
+        if (m.try_lock()) {
+            std::lock_guard<std::mutex> lock(m, std::adopt_lock);
+            f(container);
+            combine();
+            return;
+        }
+        slot &s = claim_slot();
+        s.run = &invoke<Function>;
+        s.context = &f;
+        s.state.store(slot_pending, std::memory_order_release);
+        pending.fetch_add(1, std::memory_order_release);
+        while (s.state.load(std::memory_order_acquire) != slot_done) {
+            if (m.try_lock()) {
+                std::lock_guard<std::mutex> lock(m, std::adopt_lock);
+                combine();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        std::exception_ptr const error = std::move(s.error);
+        s.error = nullptr;
+        s.state.store(slot_free, std::memory_order_release);
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+public:
+    template <typename Function>
+    void apply(Function f) {
+        run_exclusive(f);
+    }
+
+    // f sees the container as const; it still runs exclusively.
+    template <typename Function>
+    void apply(Function f) const {
+        auto const_f = [&](Container &c) {
+            f(static_cast<Container const &>(c));
+        };
+        run_exclusive(const_f);
+    }
+};
+
+// The same interface over a plain mutex, for structures that leave the
+// choice to their users.
+template <typename Container>
+class mutex_guarded {
+private:
+    Container container;
+    mutable std::mutex m;
+
+public:
+    template <typename... Args>
+    explicit mutex_guarded(Args &&... args):
+        container(std::forward<Args>(args)...) {
+    }
+
+    mutex_guarded(mutex_guarded const &) = delete;
+    mutex_guarded &operator=(mutex_guarded const &) = delete;
+
+    template <typename Function>
+    void apply(Function f) {
+        std::lock_guard<std::mutex> lock(m);
+        f(container);
+    }
+
+    template <typename Function>
+    void apply(Function f) const {
+        std::lock_guard<std::mutex> lock(m);
+        f(container);
+    }
+};
+
+#endif
@@ -1,85 +1,172 @@
-#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "../../lock-free/reclamation/reclaimers.h"
 
+// Singly linked list whose nodes carry a version word instead of a mutex.
+// Writers lock a node by setting the low bit of its word and bump the
+// count above it when they unlock, so a reader that sees the same even
+// word before and after reading a node's link read a consistent node
+// without writing anything. for_each and find_first_if walk that way and
+// only fall back to hand-over-hand locking, from the node that failed
+// validation on, when a writer gets in their way. Removed nodes stay
+// readable until the epoch reclaimer frees them, so a walk that is on one
+// when it is unlinked carries on through its old link.
 template <typename T>
 class threadsafe_list {
 private:
     struct node {
-        std::mutex m;
+        // Bit 0 is held by a writer, bit 1 marks the node removed and the
+        // rest counts writes.
+        std::atomic<unsigned> version;
+        std::atomic<node*> next;
         std::shared_ptr<T> data;
-        std::unique_ptr<node> next;
-        
-        node() :
-            next() {
+
+        node():
+            version(0), next(nullptr) {
         }
 
-        node(T const &value) :
-            data(std::make_shared<T>(value)) {
+        node(T const &value):
+            version(0), next(nullptr), data(std::make_shared<T>(value)) {
+        }
+
+        void lock() {
+            for (;;) {
+                unsigned v = version.load(std::memory_order_relaxed);
+                if (!(v & locked) &&
+                    version.compare_exchange_weak(v, v | locked,
+                                                  std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+                    return;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        // Clears the lock bit and counts the write; flags are or'ed in.
+        void unlock(unsigned flags = 0) {
+            unsigned const v = version.load(std::memory_order_relaxed);
+            version.store((v | flags) + 3, std::memory_order_release);
         }
     };
 
+    static unsigned const locked = 1;
+    static unsigned const removed = 2;
+
     node head;
 
+    static void delete_node(void *p) {
+        delete static_cast<node*>(p);
+    }
+
+    // Hand-over-hand from current, which the caller has locked. Returns
+    // the first element f accepts; f returning true stops the walk.
+    template <typename Function>
+    static std::shared_ptr<T> locked_walk(node *current, Function f) {
+        for (;;) {
+            if (!(current->version.load(std::memory_order_relaxed) &
+                  removed) && f(static_cast<T const &>(*current->data))) {
+                std::shared_ptr<T> res = current->data;
+                current->unlock();
+                return res;
+            }
+            node *const next = current->next.load(std::memory_order_relaxed);
+            if (!next) {
+                current->unlock();
+                return std::shared_ptr<T>();
+            }
+            next->lock();
+            current->unlock();
+            current = next;
+        }
+    }
+
+    // Visits the elements in order until f returns true and returns the
+    // one it stopped on.
+    template <typename Function>
+    std::shared_ptr<T> walk(Function f) {
+        epoch_guard g;
+        node *current = head.next.load(std::memory_order_acquire);
+        while (current) {
+            unsigned const v = current->version.load(std::memory_order_acquire);
+            node *next = nullptr;
+            if (!(v & locked)) {
+                next = current->next.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            if ((v & locked) ||
+                current->version.load(std::memory_order_relaxed) != v) {
+                current->lock();
+                return locked_walk(current, f);
+            }
+            if (!(v & removed) && f(static_cast<T const &>(*current->data))) {
+                return current->data;
+            }
+            current = next;
+        }
+        return std::shared_ptr<T>();
+    }
+
 public:
     threadsafe_list() {
     }
 
     ~threadsafe_list() {
+        node *current = head.next.load(std::memory_order_relaxed);
+        while (current) {
+            node *const next = current->next.load(std::memory_order_relaxed);
+            delete current;
+            current = next;
+        }
     }
 
     threadsafe_list(threadsafe_list const &other) = delete;
     threadsafe_list &operator=(threadsafe_list const &other) = delete;
 
     void push_front(T const &value) {
-        std::unique_ptr<node> new_node(new node(value));
-        std::lock_guard<std::mutex> lk(head.m);
-        new_node->next = std::move(head.next);
-        head.next = std::move(new_node);
+        node *const new_node = new node(value);
+        head.lock();
+        new_node->next.store(head.next.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+        head.next.store(new_node, std::memory_order_release);
+        head.unlock();
     }
 
+    // f sees each element as const: walks run concurrently with each other
+    // and, unless a writer forces the fallback, without any lock.
     template <typename Function>
     void for_each(Function f) {
-        node *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
-        while (node *const next = current->next.get()) {
-            std::unique_lock<std::mutex> next_lk(next->m);
-            lk.unlock();
-            f(*next->data);
-            current = next;
-            lk = std::move(next_lk);
-        }
+        walk([&](T const &value) {
+            f(value);
+            return false;
+        });
     }
 
     template <typename Predicate>
     std::shared_ptr<T> find_first_if(Predicate p) {
-        node *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
-        while (node *const next = current->next.get()) {
-            std::unique_lock<std::mutex> next_lk(next->m);
-            lk.unlock();
-            if (p(*next->data)) {
-                return next->data;
-            }
-            current = next;
-            lk = std::move(next_lk);
-        }
-        return std::shared_ptr<T>();
+        return walk([&](T const &value) {
+            return bool(p(value));
+        });
     }
 
     template <typename Predicate>
     void remove_if(Predicate p) {
+        epoch_guard g;
         node *current = &head;
-        std::unique_lock<std::mutex> lk(head.m);
-        while (node *const next = current->next.get()) {
-            std::unique_lock<std::mutex> next_lk(next->m);
-            if (p(*next->data)) {
-                std::unique_ptr<node> old_next = std::move(current->next);
-                current->next = std::move(next->next);
-                next_lk.unlock();
+        current->lock();
+        while (node *const next = current->next.load(
+                   std::memory_order_relaxed)) {
+            next->lock();
+            if (p(static_cast<T const &>(*next->data))) {
+                current->next.store(next->next.load(std::memory_order_relaxed),
+                                    std::memory_order_release);
+                next->unlock(removed);
+                epoch_reclaimer::retire(next, &delete_node);
             } else {
-                lk.unlock();
+                current->unlock();
                 current = next;
-                lk = std::move(next_lk);
             }
         }
+        current->unlock();
     }
 };
@@ -1,60 +1,152 @@
 #include <mutex>
-#include <list>
 #include <vector>
 #include <map>
+#include <memory>
+#include <functional>
+#include <utility>
 #include "boost/thread/shared_mutex.hpp"
 
+// Keys are split over a fixed number of stripes by the low bits of their
+// hash, and each stripe is an independently sized hash table whose
+// buckets are flat vectors. A stripe doubles its bucket count on its own
+// once it averages more than max_load entries per bucket, so a rehash only
+// ever touches one stripe: the writer builds the new table while readers
+// keep using the old one under their shared locks, and only the final
+// pointer swap excludes them.
 template <typename Key, typename Value, typename Hash=std::hash<Key>>
 class threadsafe_lookup_table {
 private:
-    class bucket_type {
+    static unsigned const stripe_bits = 4;
+    static unsigned const stripe_count = 1u << stripe_bits;
+    static std::size_t const max_load = 2;
+
+    class stripe_type {
     private:
         typedef std::pair<Key, Value> bucket_value;
-        typedef std::list<bucket_value> bucket_data;
-        typedef typename bucket_data::iterator bucket_iterator;
+        typedef std::vector<bucket_value> bucket_data;
+
+        struct table_type {
+            std::vector<bucket_data> buckets;
+            std::size_t size;
+
+            explicit table_type(std::size_t bucket_count):
+                buckets(bucket_count), size(0) {
+            }
+
+            bucket_data &bucket_for(std::size_t hash) {
+                return buckets[(hash >> stripe_bits) & (buckets.size() - 1)];
+            }
+
+            bucket_data const &bucket_for(std::size_t hash) const {
+                return buckets[(hash >> stripe_bits) & (buckets.size() - 1)];
+            }
+        };
 
-        bucket_data data;
+        std::unique_ptr<table_type> table;
+        // Readers take mutex shared. Writers hold writer_mutex throughout
+        // and take mutex exclusively only to change the table.
         mutable boost::shared_mutex mutex;
+        std::mutex writer_mutex;
 
-        bucket_iterator find_entry_for(Key const &key) const {
-            return std::find_if(data.begin(), data.end(),
-                                [&](bucket_value const &item)
-                                { return item.first == key; });
+        static typename bucket_data::const_iterator find_entry_for(
+                bucket_data const &bucket, Key const &key) {
+            for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+                if (it->first == key) {
+                    return it;
+                }
+            }
+            return bucket.end();
+        }
+
+        static typename bucket_data::iterator find_entry_for(
+                bucket_data &bucket, Key const &key) {
+            for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+                if (it->first == key) {
+                    return it;
+                }
+            }
+            return bucket.end();
         }
-    
+
+        // Called with writer_mutex held, so the table can be read without
+        // mutex while readers carry on.
+        void grow(Hash const &hasher) {
+            std::unique_ptr<table_type> bigger(
+                new table_type(table->buckets.size() * 2));
+            for (auto const &bucket : table->buckets) {
+                for (auto const &item : bucket) {
+                    bigger->bucket_for(hasher(item.first)).push_back(item);
+                }
+            }
+            bigger->size = table->size;
+            std::unique_lock<boost::shared_mutex> lock(mutex);
+            table.swap(bigger);
+        }
+
     public:
-        Value value_for(Key const &key, Value const &default_value) const {
+        explicit stripe_type(std::size_t bucket_count):
+            table(new table_type(bucket_count)) {
+        }
+
+        Value value_for(Key const &key, std::size_t hash,
+                        Value const &default_value) const {
             boost::shared_lock<boost::shared_mutex> lock(mutex);
-            bucket_iterator const found_entry = find_entry_for(key);
-            return (found_entry == data.end())?
+            bucket_data const &bucket = table->bucket_for(hash);
+            auto const found_entry = find_entry_for(bucket, key);
+            return (found_entry == bucket.end())?
                 default_value:found_entry->second;
         }
 
-        void add_or_update_mapping(Key const &key, Value const &value) {
-            std::unique_lock<boost::shared_mutex> lock(mutex);
-            bucket_iterator const found_entry = find_entry_for(key);
-            if (found_entry == data.end()) {
-                data.push_back(bucket_value(key, value));
-            } else {
-                found_entry->second = value;
+        void add_or_update_mapping(Key const &key, std::size_t hash,
+                                   Value const &value, Hash const &hasher) {
+            std::lock_guard<std::mutex> writer(writer_mutex);
+            {
+                std::unique_lock<boost::shared_mutex> lock(mutex);
+                bucket_data &bucket = table->bucket_for(hash);
+                auto const found_entry = find_entry_for(bucket, key);
+                if (found_entry != bucket.end()) {
+                    found_entry->second = value;
+                    return;
+                }
+                bucket.push_back(bucket_value(key, value));
+                ++table->size;
+            }
+            if (table->size > table->buckets.size() * max_load) {
+                grow(hasher);
             }
         }
 
-        void remove_mapping(Key const &key) {
+        void remove_mapping(Key const &key, std::size_t hash) {
+            std::lock_guard<std::mutex> writer(writer_mutex);
             std::unique_lock<boost::shared_mutex> lock(mutex);
-            bucket_iterator const found_entry = find_entry_for(key);
-            if (found_entry != data.end()) {
-                data.erase(found_entry);
+            bucket_data &bucket = table->bucket_for(hash);
+            auto const found_entry = find_entry_for(bucket, key);
+            if (found_entry != bucket.end()) {
+                if (found_entry + 1 != bucket.end()) {
+                    *found_entry = std::move(bucket.back());
+                }
+                bucket.pop_back();
+                --table->size;
+            }
+        }
+
+        boost::shared_mutex &get_mutex() const {
+            return mutex;
+        }
+
+        // Caller holds mutex.
+        void copy_to(std::map<Key, Value> &res) const {
+            for (auto const &bucket : table->buckets) {
+                res.insert(bucket.begin(), bucket.end());
             }
         }
     };
 
-    std::vector<std::unique_ptr<bucket_type>> buckets;
+    std::vector<std::unique_ptr<stripe_type>> stripes;
     Hash hasher;
 
-    bucket_type &get_bucket(Key const &key) const {
-        std::size_t const bucket_index = hasher(key) & buckets.size();
-        return *buckets[bucket_index];
+    stripe_type &get_stripe(std::size_t hash) const {
+        return *stripes[hash & (stripe_count - 1)];
     }
 
 public:
@@ -62,12 +154,18 @@ public:
     typedef Value mapped_type;
     typedef Hash hash_type;
 
+    // num_buckets is rounded up to a power of two and spread over the
+    // stripes; the table grows from there as needed.
     threadsafe_lookup_table(
             unsigned num_buckets = 19, Hash const &hasher_ = Hash()):
-            buckets(num_buckets), hasher(hasher_) {
-        for (unsigned i = 0; i < num_buckets; ++i) {
-            buckets[i].reset(new bucket_type);
-        }        
+            stripes(stripe_count), hasher(hasher_) {
+        std::size_t per_stripe = 1;
+        while (per_stripe * stripe_count < num_buckets) {
+            per_stripe <<= 1;
+        }
+        for (unsigned i = 0; i < stripe_count; ++i) {
+            stripes[i].reset(new stripe_type(per_stripe));
+        }
     }
 
     threadsafe_lookup_table(threadsafe_lookup_table const &other) = delete;
@@ -75,29 +173,31 @@ public:
             threadsafe_lookup_table const &other) = delete;
 
     Value value_for(Key const &key, Value const &default_value = Value()) const {
-        return get_bucket(key).value_for(key, default_value);
+        std::size_t const hash = hasher(key);
+        return get_stripe(hash).value_for(key, hash, default_value);
     }
 
     void add_or_update_mapping(Key const &key, Value const &value) {
-        return get_bucket(key).add_or_update_mapping(key, value);
+        std::size_t const hash = hasher(key);
+        get_stripe(hash).add_or_update_mapping(key, hash, value, hasher);
     }
 
     void remove_mapping(Key const &key) {
-        get_bucket(key).remove_mapping(key);
+        std::size_t const hash = hasher(key);
+        get_stripe(hash).remove_mapping(key, hash);
     }
 
+    // A consistent snapshot. Stripes are locked shared and in order, so
+    // lookups carry on throughout and writers only wait on their stripe.
     std::map<Key, Value> get_map() const {
-        std::vector<std::unique_lock<boost::shared_mutex>> locks;
-        for (unsigned i = 0; i < buckets.size(); ++i) {
-            locks.push_back(
-                    std::unique_lock<boost::shared_mutex>(buckets[i].mutex));
+        std::vector<boost::shared_lock<boost::shared_mutex>> locks;
+        for (unsigned i = 0; i < stripe_count; ++i) {
+            locks.push_back(boost::shared_lock<boost::shared_mutex>(
+                stripes[i]->get_mutex()));
         }
         std::map<Key, Value> res;
-        for (unsigned i = 0; i < buckets.size(); ++i) {
-            for (auto it = buckets[i].data.begin();
-                 it != buckets[i].data.end(); ++it) {
-                res.insert(*it);
-            }
+        for (unsigned i = 0; i < stripe_count; ++i) {
+            stripes[i]->copy_to(res);
         }
         return res;
     }
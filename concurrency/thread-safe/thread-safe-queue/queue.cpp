@@ -1,63 +1,332 @@
-#include <queue>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <memory>
 #include <mutex>
-#include <condition_variable>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../../lock-free/reclamation/node_pool.h"
 
+// Two-lock queue after Michael and Scott. head is a dummy node and values
+// live in the nodes after it; pushes serialize on tail_mutex and pops on
+// head_mutex, and since a pop finds its value through head->next it never
+// needs the tail lock, so producers and consumers only meet on the node
+// being linked. A push builds its node, value included, before taking the
+// tail lock, and values are moved, never copied, on the way through.
+// Nodes come from a node_pool. A waiting consumer retries a few times,
+// yielding in between, before it sleeps, and pushes only touch head_mutex
+// to wake someone when a consumer is actually asleep.
+//
+// close() makes further pushes throw and wakes every waiting consumer;
+// consumers drain what is left and then see the queue as closed.
 template <typename T>
 class threadsafe_queue {
 private:
-    mutable std::mutex mut;
-    std::queue<T> data_queue;
+    struct node {
+        std::atomic<node*> next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        node():
+            next(nullptr) {
+        }
+
+        T &data() {
+            return *reinterpret_cast<T*>(&storage);
+        }
+    };
+
+    typedef node_pool<node> pool;
+
+    static std::size_t const cache_line = 64;
+    static unsigned const spin_count = 64;
+
+    char pad0[cache_line];
+    mutable std::mutex head_mutex;
+    node *head;
     std::condition_variable data_cond;
+    char pad1[cache_line];
+    std::mutex tail_mutex;
+    node *tail;
+    char pad2[cache_line];
+    // Consumers inside wait; pushes only touch head_mutex when non-zero.
+    std::atomic<unsigned> waiters;
+    // Written under both locks, so either one is enough to read it.
+    bool closed;
+
+    static void free_node(node *n) {
+        n->~node();
+        pool::deallocate(n);
+    }
+
+    // Frees n nodes starting at first, following their next links.
+    static void free_nodes(node *first, std::size_t n) {
+        for (; n; --n) {
+            node *const next = first->next.load(std::memory_order_relaxed);
+            free_node(first);
+            first = next;
+        }
+    }
+
+    // Caller holds head_mutex. Unlinks the dummy and moves the value out
+    // of its successor, which becomes the new dummy.
+    node *pop_head(node *next, T &value) {
+        node *const old_head = head;
+        value = std::move(next->data());
+        next->data().~T();
+        head = next;
+        return old_head;
+    }
+
+    node *pop_head(node *next, std::shared_ptr<T> &value) {
+        node *const old_head = head;
+        value = std::make_shared<T>(std::move(next->data()));
+        next->data().~T();
+        head = next;
+        return old_head;
+    }
+
+    // The wait predicate pairs with the seq_cst link in push_value and the
+    // load of waiters after it: either the push sees this consumer counted
+    // or the consumer sees the new node.
+    node *wait_next() {
+        return head->next.load();
+    }
+
+    // Caller holds head_mutex. Returns head's successor, sleeping until
+    // there is one, or nullptr once the queue is closed and empty. Only
+    // a consumer that actually has to sleep counts itself in waiters.
+    node *wait_for_next(std::unique_lock<std::mutex> &head_lock) {
+        node *next = head->next.load(std::memory_order_acquire);
+        if (!next && !closed) {
+            ++waiters;
+            data_cond.wait(head_lock, [&] {
+                return (next = wait_next()) || closed;
+            });
+            --waiters;
+        }
+        return next;
+    }
+
+    template <typename U>
+    void push_value(U &&new_value) {
+        node *const p = new (pool::allocate()) node;
+        try {
+            new (&p->storage) T(std::forward<U>(new_value));
+        } catch (...) {
+            free_node(p);
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            if (closed) {
+                p->data().~T();
+                free_node(p);
+                throw std::runtime_error("push on closed threadsafe_queue");
+            }
+            tail->next.store(p);
+            tail = p;
+        }
+        if (waiters.load()) {
+            {
+                std::lock_guard<std::mutex> head_lock(head_mutex);
+            }
+            data_cond.notify_one();
+        }
+    }
+
 public:
-    threadsafe_queue() {
+    threadsafe_queue():
+        head(new (pool::allocate()) node), tail(head), waiters(0),
+        closed(false) {
     }
-    threadsafe_queue(threadsafe_queue const &other) {
-        std::lock_guard<std::mutex> lk(other.mut);
-        data_queue = other.data_queue;
+
+    threadsafe_queue(threadsafe_queue const &other) = delete;
+    threadsafe_queue &operator=(threadsafe_queue const &other) = delete;
+
+    ~threadsafe_queue() {
+        node *n = head->next.load(std::memory_order_relaxed);
+        free_node(head);
+        while (n) {
+            node *const next = n->next.load(std::memory_order_relaxed);
+            n->data().~T();
+            free_node(n);
+            n = next;
+        }
     }
 
-    void push(T new_value) {
-        std::lock_guard<std::mutex> lk(mut);
-        data_queue.push(new_value);
-        data_cond.notify_one();
+    void push(T const &new_value) {
+        push_value(new_value);
     }
 
-    void wait_and_pop(T &value) {
-        std::unique_lock<std::mutex> lk(mut);
-        data_cond.wait(lk, [this]{return !data_queue.empty();});
-        value = data_queue.front();
-        data_queue.pop();
+    void push(T &&new_value) {
+        push_value(std::move(new_value));
     }
 
-    std::shared_ptr<T> wait_and_pop() {
-        std::unique_lock<std::mutex> lk(mut);
-        data_cond.wait(lk, [this]{return !data_queue.empty();});
-        std::shared_ptr<T> res(std::make_shared<T>(data_queue.front()));
-        data_queue.pop();
-        return res;
+    // Pushes after this throw; waiting consumers wake up and, once the
+    // queue is drained, wait_and_pop returns false.
+    void close() {
+        {
+            std::lock_guard<std::mutex> head_lock(head_mutex);
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            closed = true;
+        }
+        data_cond.notify_all();
     }
 
     bool try_pop(T &value) {
-        std::lock_guard<std::mutex> lk(mut);
-        if (data_queue.empty())
-            return false;
-        value = data_queue.front();
-        data_queue.pop();
+        node *old_head;
+        {
+            std::lock_guard<std::mutex> head_lock(head_mutex);
+            node *const next = head->next.load(std::memory_order_acquire);
+            if (!next) {
+                return false;
+            }
+            old_head = pop_head(next, value);
+        }
+        free_node(old_head);
         return true;
     }
 
     std::shared_ptr<T> try_pop() {
-        std::lock_guard<std::mutex> lk(mut);
-        if (data_queue.empty())
-            return std::shared_ptr<T>();
-        std::shared_ptr<T> res(std::make_shared<T>(data_queue.front()));
-        data_queue.pop();
+        std::shared_ptr<T> res;
+        node *old_head;
+        {
+            std::lock_guard<std::mutex> head_lock(head_mutex);
+            node *const next = head->next.load(std::memory_order_acquire);
+            if (!next) {
+                return res;
+            }
+            old_head = pop_head(next, res);
+        }
+        free_node(old_head);
+        return res;
+    }
+
+    // Returns false only once the queue is closed and empty.
+    bool wait_and_pop(T &value) {
+        for (unsigned spins = 0; spins < spin_count; ++spins) {
+            if (try_pop(value)) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        node *old_head;
+        {
+            std::unique_lock<std::mutex> head_lock(head_mutex);
+            node *const next = wait_for_next(head_lock);
+            if (!next) {
+                return false;
+            }
+            old_head = pop_head(next, value);
+        }
+        free_node(old_head);
+        return true;
+    }
+
+    // Returns nullptr only once the queue is closed and empty.
+    std::shared_ptr<T> wait_and_pop() {
+        std::shared_ptr<T> res;
+        for (unsigned spins = 0; spins < spin_count; ++spins) {
+            if ((res = try_pop())) {
+                return res;
+            }
+            std::this_thread::yield();
+        }
+        node *old_head;
+        {
+            std::unique_lock<std::mutex> head_lock(head_mutex);
+            node *const next = wait_for_next(head_lock);
+            if (!next) {
+                return res;
+            }
+            old_head = pop_head(next, res);
+        }
+        free_node(old_head);
         return res;
     }
 
+    // Returns false if nothing arrived within timeout or the queue is
+    // closed and empty.
+    template <typename Rep, typename Period>
+    bool wait_and_pop_for(T &value,
+                          std::chrono::duration<Rep, Period> const &timeout) {
+        node *old_head;
+        {
+            std::unique_lock<std::mutex> head_lock(head_mutex);
+            node *next = head->next.load(std::memory_order_acquire);
+            if (!next && !closed) {
+                ++waiters;
+                data_cond.wait_for(head_lock, timeout, [&] {
+                    return (next = wait_next()) || closed;
+                });
+                --waiters;
+            }
+            if (!next) {
+                return false;
+            }
+            old_head = pop_head(next, value);
+        }
+        free_node(old_head);
+        return true;
+    }
+
+    // Appends everything queued to out under one acquisition of head_mutex
+    // and returns how many values were taken. Pushes carry on meanwhile;
+    // whatever they link after the walk started may or may not be taken.
+    // If moving a value into out throws, the values before it stay taken
+    // and the rest stay queued.
+    std::size_t try_pop_all(std::vector<T> &out) {
+        node *old_head;
+        std::size_t count = 0;
+        std::size_t taken = 0;
+        {
+            std::lock_guard<std::mutex> head_lock(head_mutex);
+            node *last = head;
+            for (node *n; (n = last->next.load(std::memory_order_acquire));
+                 last = n) {
+                ++count;
+            }
+            if (!count) {
+                return 0;
+            }
+            // Only into an empty vector, so repeated drains into the same
+            // one keep its geometric growth.
+            if (out.empty()) {
+                out.reserve(count);
+            }
+            // Each drained node becomes the dummy as soon as its value is
+            // out, as in pop_head; the old dummies are freed outside the
+            // lock.
+            old_head = head;
+            try {
+                while (head != last) {
+                    node *const next = head->next.load(std::memory_order_relaxed);
+                    out.push_back(std::move(next->data()));
+                    next->data().~T();
+                    head = next;
+                    ++taken;
+                }
+            } catch (...) {
+                free_nodes(old_head, taken);
+                throw;
+            }
+        }
+        free_nodes(old_head, count);
+        return count;
+    }
+
     bool empty() const {
-        std::lock_guard<std::mutex> lk(mut);
-        return data_queue.empty();
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        return !head->next.load(std::memory_order_acquire);
+    }
+
+    bool is_closed() const {
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        return closed;
     }
 };
@@ -0,0 +1,365 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "../../lock-free/reclamation/reclaimers.h"
+
+// Sorted set on the lazy skip list of Herlihy, Lev, Luchangco and Shavit.
+// Lookups and walks take no locks and write nothing shared: they run
+// inside an epoch region and skip nodes that are not yet fully linked or
+// already marked removed. An insert or remove locks only the predecessors
+// it relinks (and the victim), validates that they are still adjacent and
+// unmarked, and retries the search otherwise. Removed nodes are retired
+// through epoch_reclaimer, so a reader can keep walking from a node that
+// was unlinked under it.
+//
+// Elements are immutable once inserted; Compare decides equivalence, so a
+// T can carry a payload that Compare ignores and find() copies it out.
+template <typename T, typename Compare = std::less<T>>
+class threadsafe_skip_list {
+private:
+    // With one node in four promoted per level, enough for ~4^16 elements.
+    static int const max_level = 16;
+
+    struct node {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        std::atomic<bool> locked;
+        std::atomic<bool> marked;
+        std::atomic<bool> fully_linked;
+        int const top_level;
+        // top_level + 1 entries; the rest are allocated past the end.
+        std::atomic<node*> next[1];
+
+        explicit node(int top_level_):
+            locked(false), marked(false), fully_linked(false),
+            top_level(top_level_) {
+            next[0].store(nullptr, std::memory_order_relaxed);
+            for (int level = 1; level <= top_level; ++level) {
+                new (&next[level]) std::atomic<node*>(nullptr);
+            }
+        }
+
+        T &data() {
+            return *reinterpret_cast<T*>(&storage);
+        }
+
+        void lock() {
+            while (locked.exchange(true, std::memory_order_acquire)) {
+                while (locked.load(std::memory_order_relaxed)) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        void unlock() {
+            locked.store(false, std::memory_order_release);
+        }
+    };
+
+    node *head;
+    Compare comp;
+    std::atomic<std::size_t> count;
+
+    static node *allocate_node(int top_level) {
+        void *const mem = ::operator new(
+            sizeof(node) + top_level * sizeof(std::atomic<node*>));
+        return new (mem) node(top_level);
+    }
+
+    static void free_node(node *n) {
+        n->~node();
+        ::operator delete(n);
+    }
+
+    // Deleter for nodes that held a value.
+    static void destroy_node(void *p) {
+        node *const n = static_cast<node*>(p);
+        n->data().~T();
+        free_node(n);
+    }
+
+    static int random_level() {
+        thread_local static std::uint32_t seed = std::uint32_t(
+            reinterpret_cast<std::uintptr_t>(&seed) >> 4) | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int level = 0;
+        for (std::uint32_t r = seed; level < max_level - 1 && !(r & 3);
+             r >>= 2) {
+            ++level;
+        }
+        return level;
+    }
+
+    static bool is_live(node *n) {
+        return n->fully_linked.load(std::memory_order_acquire) &&
+            !n->marked.load(std::memory_order_acquire);
+    }
+
+    // Fills preds and succs at every level around key and returns the
+    // highest level at which a node equivalent to key was found, or -1.
+    int find_position(T const &key, node **preds, node **succs) const {
+        int found = -1;
+        node *pred = head;
+        for (int level = max_level - 1; level >= 0; --level) {
+            node *curr = pred->next[level].load(std::memory_order_acquire);
+            while (curr && comp(curr->data(), key)) {
+                pred = curr;
+                curr = pred->next[level].load(std::memory_order_acquire);
+            }
+            if (found == -1 && curr && !comp(key, curr->data())) {
+                found = level;
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+        return found;
+    }
+
+    // First node at level 0 not ordered before key, live or not.
+    node *lower_bound(T const &key) const {
+        node *pred = head;
+        node *curr = nullptr;
+        for (int level = max_level - 1; level >= 0; --level) {
+            curr = pred->next[level].load(std::memory_order_acquire);
+            while (curr && comp(curr->data(), key)) {
+                pred = curr;
+                curr = pred->next[level].load(std::memory_order_acquire);
+            }
+        }
+        return curr;
+    }
+
+    // Predecessors repeat on consecutive levels and are locked once.
+    static void unlock_preds(node **preds, int highest_locked) {
+        node *prev = nullptr;
+        for (int level = 0; level <= highest_locked; ++level) {
+            if (preds[level] != prev) {
+                preds[level]->unlock();
+                prev = preds[level];
+            }
+        }
+    }
+
+    template <typename U>
+    bool insert_value(U &&value) {
+        int const top_level = random_level();
+        node *const n = allocate_node(top_level);
+        try {
+            new (&n->storage) T(std::forward<U>(value));
+        } catch (...) {
+            free_node(n);
+            throw;
+        }
+        T const &key = n->data();
+        node *preds[max_level];
+        node *succs[max_level];
+        epoch_guard g;
+        for (;;) {
+            int const found = find_position(key, preds, succs);
+            if (found != -1) {
+                node *const existing = succs[found];
+                if (!existing->marked.load(std::memory_order_acquire)) {
+                    while (!existing->fully_linked.load(
+                               std::memory_order_acquire)) {
+                        std::this_thread::yield();
+                    }
+                    destroy_node(n);
+                    return false;
+                }
+                // Being removed; wait for it to be unlinked.
+                std::this_thread::yield();
+                continue;
+            }
+            int highest_locked = -1;
+            node *prev = nullptr;
+            bool valid = true;
+            for (int level = 0; valid && level <= top_level; ++level) {
+                node *const pred = preds[level];
+                node *const succ = succs[level];
+                if (pred != prev) {
+                    pred->lock();
+                    prev = pred;
+                }
+                highest_locked = level;
+                valid = !pred->marked.load(std::memory_order_relaxed) &&
+                    (!succ || !succ->marked.load(std::memory_order_relaxed)) &&
+                    pred->next[level].load(std::memory_order_relaxed) == succ;
+            }
+            if (!valid) {
+                unlock_preds(preds, highest_locked);
+                continue;
+            }
+            for (int level = 0; level <= top_level; ++level) {
+                n->next[level].store(succs[level], std::memory_order_relaxed);
+            }
+            for (int level = 0; level <= top_level; ++level) {
+                preds[level]->next[level].store(n, std::memory_order_release);
+            }
+            n->fully_linked.store(true, std::memory_order_release);
+            unlock_preds(preds, highest_locked);
+            count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+public:
+    explicit threadsafe_skip_list(Compare const &comp_ = Compare()):
+        head(allocate_node(max_level - 1)), comp(comp_), count(0) {
+    }
+
+    threadsafe_skip_list(threadsafe_skip_list const &other) = delete;
+    threadsafe_skip_list &operator=(
+            threadsafe_skip_list const &other) = delete;
+
+    ~threadsafe_skip_list() {
+        node *n = head->next[0].load(std::memory_order_relaxed);
+        free_node(head);
+        while (n) {
+            node *const next = n->next[0].load(std::memory_order_relaxed);
+            destroy_node(n);
+            n = next;
+        }
+    }
+
+    // Returns false, leaving the set unchanged, if an equivalent element
+    // is already present.
+    bool insert(T const &value) {
+        return insert_value(value);
+    }
+
+    bool insert(T &&value) {
+        return insert_value(std::move(value));
+    }
+
+    bool remove(T const &key) {
+        node *preds[max_level];
+        node *succs[max_level];
+        node *victim = nullptr;
+        int top_level = -1;
+        epoch_guard g;
+        for (;;) {
+            int const found = find_position(key, preds, succs);
+            if (!victim) {
+                // Only a fully linked node found at its own top level is
+                // completely in the list.
+                if (found == -1) {
+                    return false;
+                }
+                node *const candidate = succs[found];
+                if (!candidate->fully_linked.load(std::memory_order_acquire) ||
+                    candidate->top_level != found) {
+                    return false;
+                }
+                candidate->lock();
+                if (candidate->marked.load(std::memory_order_relaxed)) {
+                    candidate->unlock();
+                    return false;
+                }
+                candidate->marked.store(true, std::memory_order_release);
+                victim = candidate;
+                top_level = victim->top_level;
+            }
+            int highest_locked = -1;
+            node *prev = nullptr;
+            bool valid = true;
+            for (int level = 0; valid && level <= top_level; ++level) {
+                node *const pred = preds[level];
+                if (pred != prev) {
+                    pred->lock();
+                    prev = pred;
+                }
+                highest_locked = level;
+                valid = !pred->marked.load(std::memory_order_relaxed) &&
+                    pred->next[level].load(std::memory_order_relaxed) == victim;
+            }
+            if (!valid) {
+                unlock_preds(preds, highest_locked);
+                continue;
+            }
+            for (int level = top_level; level >= 0; --level) {
+                preds[level]->next[level].store(
+                    victim->next[level].load(std::memory_order_relaxed),
+                    std::memory_order_release);
+            }
+            victim->unlock();
+            unlock_preds(preds, highest_locked);
+            count.fetch_sub(1, std::memory_order_relaxed);
+            epoch_reclaimer::retire(victim, &destroy_node);
+            return true;
+        }
+    }
+
+    bool contains(T const &key) const {
+        epoch_guard g;
+        node *const n = lower_bound(key);
+        return n && !comp(key, n->data()) && is_live(n);
+    }
+
+    // Copies the element equivalent to key into value.
+    bool find(T const &key, T &value) const {
+        epoch_guard g;
+        node *const n = lower_bound(key);
+        if (!n || comp(key, n->data()) || !is_live(n)) {
+            return false;
+        }
+        value = n->data();
+        return true;
+    }
+
+    // Calls f on every element in order. Elements inserted or removed
+    // during the walk may or may not be seen.
+    template <typename Function>
+    void for_each(Function f) const {
+        epoch_guard g;
+        for (node *n = head->next[0].load(std::memory_order_acquire); n;
+             n = n->next[0].load(std::memory_order_acquire)) {
+            if (is_live(n)) {
+                f(const_cast<T const &>(n->data()));
+            }
+        }
+    }
+
+    // Calls f, in order, on the elements in [first, last).
+    template <typename Function>
+    void for_each(T const &first, T const &last, Function f) const {
+        epoch_guard g;
+        for (node *n = lower_bound(first); n && comp(n->data(), last);
+             n = n->next[0].load(std::memory_order_acquire)) {
+            if (is_live(n)) {
+                f(const_cast<T const &>(n->data()));
+            }
+        }
+    }
+
+    // Removes the elements satisfying p and returns how many this call
+    // removed.
+    template <typename Predicate>
+    std::size_t remove_if(Predicate p) {
+        std::size_t removed = 0;
+        epoch_guard g;
+        for (node *n = head->next[0].load(std::memory_order_acquire); n;
+             n = n->next[0].load(std::memory_order_acquire)) {
+            // An unlinked node keeps its next pointers, and the guard keeps
+            // it allocated, so the walk can carry on from it.
+            if (is_live(n) && p(const_cast<T const &>(n->data())) &&
+                remove(n->data())) {
+                ++removed;
+            }
+        }
+        return removed;
+    }
+
+    std::size_t size() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return !size();
+    }
+};
@@ -1,44 +1,101 @@
+#include <cstddef>
 #include <exception>
 #include <memory>
-#include <mutex>
 #include <stack>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../flat-combining/flat_combining.h"
 
 struct empty_stack: std::exception {
   const char* what() const throw();
 };
 
-template<typename T>
+// Elements are moved in and out, so move-only T works as long as the
+// stack itself is not copied.
+//
+// With Combining set the stack sits behind flat_combining rather than a
+// plain mutex: under contention one thread applies a batch of pending
+// operations for the others, while uncontended operations cost about the
+// same as with the mutex.
+template<typename T, bool Combining = false>
 class threadsafe_stack {
 private:
-  std::stack<T> data;
-  mutable std::mutex m;
+  typedef typename std::conditional<Combining,
+    flat_combining<std::stack<T>>, mutex_guarded<std::stack<T>>>::type
+    guarded_stack;
+
+  guarded_stack data;
+
+  static std::stack<T> copy_of(const threadsafe_stack&other) {
+    std::stack<T> res;
+    other.data.apply([&](std::stack<T> const &s) { res = s; });
+    return res;
+  }
+
 public:
   threadsafe_stack() {};
-  threadsafe_stack(const threadsafe_stack&other) {
-    std::lock_guard<std::mutex> lock(other.m);
-    data = other.data;
+  threadsafe_stack(const threadsafe_stack&other):
+    data(copy_of(other)) {
   }
   threadsafe_stack& operator=(const threadsafe_stack&) = delete;
 
-  void push(T new_value) {
-    std::lock_guard<std::mutex> lock(m);
-    data.push(new_value);
+  void push(T const &new_value) {
+    data.apply([&](std::stack<T> &s) { s.push(new_value); });
+  }
+  void push(T &&new_value) {
+    data.apply([&](std::stack<T> &s) { s.push(std::move(new_value)); });
   }
   std::shared_ptr<T> pop() {
-    std::lock_guard<std::mutex> lock(m);
-    if (data.empty()) throw empty_stack();
-    std::shared_ptr<T> const res(std::make_shared<T>(data.top()));
-    data.pop();
+    std::shared_ptr<T> res = try_pop();
+    if (!res) throw empty_stack();
     return res;
   }
   void pop(T& value) {
-    std::lock_guard<std::mutex> lock(m);
-    if (data.empty()) throw empty_stack();
-    value = data.top();
-    data.pop();
+    if (!try_pop(value)) throw empty_stack();
+  }
+  // Non-throwing pops; prefer these where empty is a normal outcome.
+  bool try_pop(T& value) {
+    bool popped = false;
+    data.apply([&](std::stack<T> &s) {
+      if (s.empty()) return;
+      value = std::move(s.top());
+      s.pop();
+      popped = true;
+    });
+    return popped;
+  }
+  std::shared_ptr<T> try_pop() {
+    std::shared_ptr<T> res;
+    data.apply([&](std::stack<T> &s) {
+      if (s.empty()) return;
+      res = std::make_shared<T>(std::move(s.top()));
+      s.pop();
+    });
+    return res;
+  }
+  // Appends up to n elements to out, top first, under one acquisition;
+  // returns how many were popped.
+  std::size_t pop_n(std::vector<T> &out, std::size_t n) {
+    std::size_t popped = 0;
+    data.apply([&](std::stack<T> &s) {
+      // Only into an empty vector: reserving exactly on every call would
+      // defeat the vector's geometric growth across repeated drains.
+      if (out.empty()) out.reserve(s.size() < n ? s.size() : n);
+      for (; popped < n && !s.empty(); ++popped) {
+        out.push_back(std::move(s.top()));
+        s.pop();
+      }
+    });
+    return popped;
   }
   bool empty() const {
-    std::lock_guard<std::mutex> lock(m);
-    return data.empty();
+    bool res = false;
+    data.apply([&](std::stack<T> const &s) { res = s.empty(); });
+    return res;
   }
 };
+
+// Drop-in for threadsafe_stack where many threads hit one stack at once.
+template<typename T>
+using combining_stack = threadsafe_stack<T, true>;
@@ -1,10 +1,8 @@
 #ifndef MESSAGING_H
 #define MESSAGING_H
 
-#include <mutex>
-#include <condition_variable>
-#include <queue>
 #include <memory>
+#include "../../concurrency/lock-free/mpsc-queue/mpsc_queue.h"
 
 namespace messaging {
 
@@ -22,23 +20,18 @@ struct wrapped_message : message_base {
     }
 };
 
+// Any number of senders, but only the owning receiver pops.
 class queue {
-    std::mutex m;
-    std::condition_variable c;
-    std::queue<std::shared_ptr<message_base>> q;
+    blocking_mpsc_queue<std::shared_ptr<message_base>> q;
 public:
     template <typename T>
     void push(T const &msg) {
-        std::lock_guard<std::mutex> lk(m);
         q.push(std::make_shared<wrapped_message<T>>(msg));
-        c.notify_all();
     }
     
     std::shared_ptr<message_base> wait_and_pop() {
-        std::unique_lock<std::mutex> lk(m);
-        c.wait(lk, [&] {return !q.empty();});
-        auto res = q.front();
-        q.pop();
+        std::shared_ptr<message_base> res;
+        q.wait_and_pop(res);
         return res;
     }
 };
@@ -4,50 +4,74 @@
 #include <list>
 #include <mutex>
 #include <atomic>
+#include <type_traits>
+#include "../../concurrency/thread-safe/flat-combining/flat_combining.h"
 
 namespace TinyRPC
 {
 
-    template<class T>
+    // With Combining set the list sits behind flat_combining instead of a
+    // plain mutex. Either way m_mutex only serves sleeping consumers, and
+    // push only takes it when one is asleep.
+    template<class T, bool Combining = false>
     class ConcurrentQueue
     {
     public:
-        explicit ConcurrentQueue() : m_exitNow(false)
+        explicit ConcurrentQueue() : m_exitNow(false), m_waiters(0)
         {
         }
 
         void push(const T & e)
         {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            m_queue.push_back(e);
-            m_cv.notify_one();
+            m_queue.apply([&](std::list<T> & q) { q.push_back(e); });
+            if (m_waiters.load())
+            {
+                std::lock_guard<std::mutex> lk(m_mutex);
+                m_cv.notify_one();
+            }
         }
 
         bool pop(T & rv)
         {
-            std::unique_lock<std::mutex> lk(m_mutex);
-            while (m_queue.empty() && !m_exitNow)
-                m_cv.wait(lk);
+            bool popped = false;
+            auto tryPop = [&](std::list<T> & q)
+            {
+                if (q.empty())
+                    return;
+                rv = q.front();
+                q.pop_front();
+                popped = true;
+            };
             if (m_exitNow)
                 return false;
-            ASSERT(!m_queue.empty(), "");
-            rv = m_queue.front();
-            m_queue.pop_front();
-            return true;
+            m_queue.apply(tryPop);
+            if (popped)
+                return true;
+            std::unique_lock<std::mutex> lk(m_mutex);
+            ++m_waiters;
+            while (!m_exitNow)
+            {
+                m_queue.apply(tryPop);
+                if (popped)
+                    break;
+                m_cv.wait(lk);
+            }
+            --m_waiters;
+            return popped;
         }
 
         std::list<T> popAll()
         {
-            std::lock_guard<std::mutex> lk(m_mutex);
             std::list<T> rv;
-            rv.swap(m_queue);
+            m_queue.apply([&](std::list<T> & q) { rv.swap(q); });
             return rv;
         }
 
         size_t size()
         {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            return m_queue.size();
+            size_t rv = 0;
+            m_queue.apply([&](std::list<T> & q) { rv = q.size(); });
+            return rv;
         }
 
         void signalForKill()
@@ -57,9 +81,17 @@ namespace TinyRPC
             m_cv.notify_all();
         }
     private:
-        std::list<T> m_queue;
+        typename std::conditional<Combining,
+            flat_combining<std::list<T>>, mutex_guarded<std::list<T>>>::type
+            m_queue;
         std::mutex m_mutex;
         std::condition_variable m_cv;
         std::atomic<bool> m_exitNow;
+        // Consumers inside pop's slow path; push notifies only when non-zero.
+        std::atomic<unsigned> m_waiters;
     };
-}
\ No newline at end of file
+
+    // Drop-in for ConcurrentQueue where many threads push at once.
+    template<class T>
+    using CombiningConcurrentQueue = ConcurrentQueue<T, true>;
+}